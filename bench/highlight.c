@@ -0,0 +1,127 @@
+// 语法高亮的基准测试
+// 在内存中生成 C 代码和以块注释为主的两种文本，用 C 的语法定义逐行调用 editorHighlight，
+// 输出每秒高亮的字节数。只测高亮和生成区间，不包括生成 render 和把区间复制到行中
+// 用法：bench/highlight [每种文本的 MB 数 [遍数]]
+#define main kilo_main
+#include "../kilo.c"
+#undef main
+
+static const char *benchCode[] = {
+    "#include <stdio.h>",
+    "",
+    "// compute a rolling checksum of a buffer",
+    "static int checksum(const unsigned char *buf, size_t len, int seed)",
+    "{",
+    "    int sum = seed ^ 0x1234;",
+    "    for (size_t i = 0; i < len; i++)",
+    "        sum = (sum * 31 + buf[i]) & 0xffff; /* keep 16 bits */",
+    "    if (sum == 42 || len > 1024)",
+    "        printf(\"checksum %d of %zu bytes: %s\\n\", sum, len, \"done\");",
+    "    else if (buf[0] == '\\n')",
+    "        return -1;",
+    "    return sum;",
+    "}",
+    NULL};
+
+static const char *benchComment[] = {
+    "/*",
+    " * Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod",
+    " * tempor incididunt ut labore et dolore magna aliqua. Ut enim ad minim",
+    " * veniam, quis nostrud exercitation ullamco laboris nisi ut aliquip ex ea",
+    " * commodo consequat. Duis aute irure dolor in reprehenderit in voluptate.",
+    " */",
+    "int value = 1;",
+    NULL};
+
+// 把 lines 循环拼接到至少 size 字节，ends 记录每行结尾
+char *benchText(const char **lines, size_t size, size_t **ends, size_t *nlines)
+{
+    char *text = malloc(size + 256);
+    size_t cap = 1024, n = 0, len = 0, i = 0;
+    *ends = malloc(sizeof(size_t) * cap);
+    if (text == NULL || *ends == NULL)
+        die("malloc");
+    while (len < size)
+    {
+        if (lines[i] == NULL)
+            i = 0;
+        size_t l = strlen(lines[i]);
+        memcpy(&text[len], lines[i], l);
+        len += l;
+        if (n == cap)
+        {
+            cap *= 2;
+            *ends = realloc(*ends, sizeof(size_t) * cap);
+            if (*ends == NULL)
+                die("realloc");
+        }
+        (*ends)[n++] = len;
+        i++;
+    }
+    *nlines = n;
+    return text;
+}
+
+// 高亮整段文本 passes 遍，返回最快一遍的 MB/s
+double benchHighlight(const char *text, const size_t *ends, size_t n, int passes)
+{
+    struct hlsink sink = {NULL, 0, 0, 0, HL_NORMAL, 0, 0};
+    double best = 0;
+    int p;
+    for (p = 0; p < passes; p++)
+    {
+        double start = editorNow();
+        size_t i, at = 0;
+        int state = 0;
+        for (i = 0; i < n; i++)
+        {
+            size_t len = ends[i] - at;
+            editorHlReset(&sink);
+            state = editorHighlight(&text[at], len, state, &sink);
+            at = ends[i];
+        }
+        double secs = editorNow() - start;
+        if (secs > 0 && ends[n - 1] / secs / 1e6 > best)
+            best = ends[n - 1] / secs / 1e6;
+    }
+    free(sink.spans);
+    return best;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t mb = argc > 1 ? strtoull(argv[1], NULL, 10) : 64;
+    int passes = argc > 2 ? atoi(argv[2]) : 5;
+    if (mb == 0)
+        mb = 1;
+    if (passes < 1)
+        passes = 1;
+
+    // 只用内置的语法定义
+    char dir[] = "/tmp/kilo-benchXXXXXX";
+    if (mkdtemp(dir) == NULL)
+        die("mkdtemp");
+    setenv("XDG_CONFIG_HOME", dir, 1);
+    initEditor();
+    E.screenrows = 24;
+    E.screencols = 80;
+    E.filename = strdup("bench.c");
+    editorSelectSyntaxHighlight();
+    if (E.syntax == NULL)
+        die("no C syntax");
+
+    const char **inputs[] = {benchCode, benchComment};
+    const char *names[] = {"code", "comments"};
+    int k;
+    for (k = 0; k < 2; k++)
+    {
+        size_t *ends, n;
+        char *text = benchText(inputs[k], mb << 20, &ends, &n);
+        printf("highlight %-8s %zu MB: %.1f MB/s\n", names[k], mb,
+               benchHighlight(text, ends, n, passes));
+        free(text);
+        free(ends);
+    }
+    rmdir(dir);
+    return 0;
+}
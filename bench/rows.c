@@ -0,0 +1,95 @@
+// 行插入、删除的基准测试
+// 生成一个 nrows 行的文件并打开，在文件开头附近和整个文件的随机位置交替插入和删除行，
+// 输出每次操作的平均耗时和行树的深度
+// 行按位置保存在隐式 treap 中，耗时只应随行数的对数增长
+// 用法：bench/rows [行数 [插入删除次数]]
+#define main kilo_main
+#include "../kilo.c"
+#undef main
+
+// 固定种子的 xorshift，每次运行的位置序列相同
+uint64_t benchRand(uint64_t *s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+// 在 [0, span) 中的随机位置交替插入和删除 ops 次，span 为 0 表示整个文件，返回平均耗时（微秒）
+void benchOps(uint64_t *seed, size_t ops, size_t span, double *ins, double *del)
+{
+    double instime = 0, deltime = 0;
+    size_t i;
+    for (i = 0; i < ops; i++)
+    {
+        size_t n = span && span < E.numrows ? span : E.numrows;
+        double start = editorNow();
+        editorInsertRow(benchRand(seed) % (n + 1), "inserted", 8);
+        instime += editorNow() - start;
+        start = editorNow();
+        editorDelRow(benchRand(seed) % n);
+        deltime += editorNow() - start;
+    }
+    *ins = ops ? instime / ops * 1e6 : 0;
+    *del = ops ? deltime / ops * 1e6 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t nrows = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+    size_t ops = argc > 2 ? strtoull(argv[2], NULL, 10) : 100000;
+    if (nrows == 0)
+        nrows = 1;
+
+    char dir[] = "/tmp/kilo-benchXXXXXX";
+    if (mkdtemp(dir) == NULL)
+        die("mkdtemp");
+    // 行索引缓存也写到临时目录中
+    setenv("XDG_CACHE_HOME", dir, 1);
+    char path[64];
+    snprintf(path, sizeof(path), "%s/rows.txt", dir);
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL)
+        die("fopen");
+    size_t i;
+    for (i = 0; i < nrows; i++)
+        fprintf(fp, "%zu the quick brown fox jumps over the lazy dog\n", i);
+    fclose(fp);
+
+    initEditor();
+    E.screenrows = 24;
+    E.screencols = 80;
+    double start = editorNow();
+    editorOpen(path);
+    editorLoadUntil(SIZE_MAX);
+    double loadtime = editorNow() - start;
+    // 最早加载的行最容易被后面的批次压到树的深处
+    int firstdepth = editorRowDepth(editorRowAt(0));
+
+    // 先在文件开头附近操作，再在整个文件中操作
+    uint64_t seed = 88172645463325252ull;
+    double topins, topdel, ins, del;
+    benchOps(&seed, ops, 100, &topins, &topdel);
+    benchOps(&seed, ops, 0, &ins, &del);
+
+    // 随机抽取一些行，统计它们在行树中的深度
+    double depth = 0;
+    int maxdepth = 0;
+    for (i = 0; i < 1000; i++)
+    {
+        int d = editorRowDepth(editorRowAt(benchRand(&seed) % E.numrows));
+        depth += d;
+        if (d > maxdepth)
+            maxdepth = d;
+    }
+
+    printf("rows %zu: load %.2f s | top ins %.2f del %.2f us | random ins %.2f del %.2f us"
+           " | depth first %d avg %.1f max %d | %zu ops\n",
+           nrows, loadtime, topins, topdel, ins, del,
+           firstdepth, depth / 1000, maxdepth, ops);
+
+    char cmd[64];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    return system(cmd);
+}
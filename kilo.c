@@ -14,12 +14,64 @@
 #include <time.h>
 #include <stdarg.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <poll.h>
+#include <dirent.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 /*** defines ***/
 
 #define KILO_VERSION "0.0.1"
 #define EDITOR_TAB_STOP 8
 #define EDITOR_QUIT_TIMES 2
+#define EDITOR_SAVE_IOV 1024        // 保存时每次 writev 提交的 iovec 数
+#define EDITOR_SAVE_BLOCK (1 << 20)  // 保存快照复制修改过的行时每块的大小
+#define EDITOR_LOAD_FIRST 256         // 后台加载第一批的行数，尽快显示第一屏
+#define EDITOR_LOAD_BATCH (64 * 1024) // 后台加载每批最多的行数
+#define EDITOR_POLL_BUDGET 0.2        // 每次处理后台任务最多占用的秒数
+#define EDITOR_INDEX_THREADS 64                // 建立行索引的最大线程数
+#define EDITOR_INDEX_CHUNK_MIN (1 << 20)       // 建立行索引时每段的最小字节数
+#define EDITOR_INDEX_CHUNK_MAX (64 << 20)      // 建立行索引时每段的最大字节数
+#define EDITOR_CACHE_MIN (1 << 20)    // 不小于这个大小的文件才缓存行索引
+#define EDITOR_CACHE_SAMPLES 64       // 缓存校验时抽样散列的块数
+#define EDITOR_CACHE_SAMPLE_SIZE 256  // 每块的字节数
+#define EDITOR_TRIGRAM_MIN (64 << 20)  // 不小于这个大小的文件加载完后在后台建立三元组索引
+#define EDITOR_TRIGRAM_BLOCK (1 << 20) // 三元组索引中每块的字节数
+#define EDITOR_TRIGRAM_SHIFT 17        // 每块的位图有 2^17 位
+#define EDITOR_TRIGRAM_OVERLAP 64      // 每块还记下从下一块开头这么多字节中开始的三元组
+#define EDITOR_RESIDENT_MARGIN 1024 // 视口上下保留 render/hl 的行数，超出后释放
+#define EDITOR_GAP_MIN 16           // 行内间隙每次扩容的最小字节数
+#define EDITOR_HL_PARALLEL_ROWS (64 * 1024) // 需要计算的行数超过它时并行计算各行的高亮状态
+#define EDITOR_HL_THREADS 64                 // 并行高亮的最大线程数
+#define EDITOR_HL_SPANS_KEEP 4096            // 高亮的临时区间超过这么多个时用完就释放
+#define EDITOR_LEX_PENDING 32 // 高亮 DFA 最多等待的字节数，更长的关键字和注释符不生效
+#define EDITOR_ARENA_SLAB (1 << 20) // 行存储每个大块的大小
+#define EDITOR_ARENA_MIN 16         // 最小的分级大小
+#define EDITOR_ARENA_CLASSES 9      // 分级个数：16、32、...、4096 字节，更大的单独申请
+#define EDITOR_ARENA_MAX (EDITOR_ARENA_MIN << (EDITOR_ARENA_CLASSES - 1))
+
+#define EDITOR_FIND_MAX_MATCHES (1 << 22) // 后台查找最多保存的匹配位置数，更多的只计数
+#define EDITOR_FIND_BATCH 4096             // 后台查找每攒够这么多匹配提交一次
+#define EDITOR_FIND_PIECE (1 << 20)        // 后台查找每扫描这么多字节检查一次是否已取消
+#define EDITOR_MATCH_CACHE 1024            // 缓存匹配位置的行数，不少于屏幕行数时滚动不必重新查找
+#define EDITOR_FRAME_GAP 8                 // 两段变化之间相同的格子少于这么多时一起输出，比移动光标省
+#define EDITOR_STATS_PAGES 4               // Ctrl-T 显示的统计信息的页数
+
+#define EDITOR_REGEX_NODES 8192  // 正则表达式编译成的 NFA 最多的节点数
+#define EDITOR_REGEX_STATES 2048 // 每个惰性 DFA 最多缓存的状态数，满了以后清空重来
+#define EDITOR_REGEX_REPEAT 1000 // {m,n} 中允许的最大次数
+#define EDITOR_REGEX_LITERAL 64  // 从正则表达式中提取的字面串最长的长度
+#define EDITOR_REGEX_DEPTH 256   // 括号最多嵌套的层数，解析时每层递归一次
+
+#define ROW_FLAT_UNKNOWN 2 // 行树节点的 flat 还没有确认
 
 #define CTRL_KEY(k) ((k) & 0x1f) // 将字符上三位设置为 0 以表示 Ctrl 键
 
@@ -46,14 +98,88 @@ enum editorHighlight
     HL_KEYWORD2,  // 关键字二
     HL_STRING,    // 字符串
     HL_NUMBER,    // 数字
-    HL_MATCH      // 搜索匹配
+    HL_MATCH,     // 当前的搜索匹配
+    HL_MATCHALL   // 屏幕上其他的搜索匹配
 };
 
 #define HL_HIGHLIGHT_NUMBERS (1 << 0)
 #define HL_HIGHLIGHT_STRINGS (1 << 1)
 
+// 高亮器使用的字符分类位
+#define CLS_SEP (1 << 0)   // 分隔符，与 is_separator 一致
+#define CLS_DIGIT (1 << 1) // 数字
+#define CLS_QUOTE (1 << 2) // 字符串引号，只在高亮字符串时设置
+
+// DFA 转移的输出：小于 DFA_OUT_HOLD 时确定一个字节，值就是它的高亮类型
+// 等于 DFA_OUT_HOLD 时这个字节还不能确定，更大的值是 outs 中的第 out - DFA_OUT_HOLD - 1 段
+#define DFA_OUT_HOLD 0x100
+#define DFA_MAX_STATES 0xffff
+#define DFA_KEY_SIZE (6 + EDITOR_LEX_PENDING) // 编译时状态的键：lexconf、待定字节数和待定字节
+
+// 可以整段跳过的状态：这些字节都回到同一状态，高亮类型相同
+#define DFA_SKIP_NONE 0
+#define DFA_SKIP_WORD 1 // 字母、数字、下划线和非 ASCII 字节
+#define DFA_SKIP_CHR 2  // 除 stop 以外的所有字节
+#define DFA_SKIP_ALL 3  // 所有字节，直到行尾
+
 /*** data ***/
 
+// 编译后的关键字，len 为 0 表示散列表中的空位
+struct keyword
+{
+    const char *word;
+    size_t len;
+    unsigned char type; // HL_KEYWORD1 或 HL_KEYWORD2
+};
+
+// DFA 的一条转移
+struct dfatrans
+{
+    unsigned short next;
+    unsigned short out;
+};
+
+// 一次确定多个字节时的高亮，在 outpool 中
+struct dfaout
+{
+    unsigned int off;
+    unsigned int len;
+};
+
+struct dfaskip
+{
+    unsigned char kind; // DFA_SKIP_*
+    unsigned char type; // 跳过的字节的高亮类型
+    unsigned char stop; // DFA_SKIP_CHR 时停下的字节
+};
+
+// 启动时由语法定义编译成的表：关键字的开放寻址散列表、字符分类表和词法分析 DFA
+// DFA 的状态 0 是普通的行首状态，每一行结束时的状态就是下一行开始时的状态
+struct syntaxtable
+{
+    struct keyword *slots;
+    size_t mask;            // 散列表大小减一，大小是 2 的幂
+    size_t maxlen;          // 最长关键字的长度，更长的词不用查表
+    unsigned char cls[256]; // 每个字节的 CLS_* 分类位
+    int nstates;
+    struct dfatrans *trans; // nstates * 256 条转移
+    struct dfatrans *eol;   // 每个状态在行尾确定剩下的字节，next 是下一行开始时的状态
+    struct dfaskip *skip;
+    struct dfaout *outs;
+    unsigned char *outpool;
+    uint64_t fingerprint; // DFA 转移表的散列，缓存的高亮状态只在指纹相同时有效
+};
+
+// 编译 DFA 时模拟的逐字节扫描器在一行中的状态，不含还没确定高亮的字节
+struct lexconf
+{
+    char in_string;    // 所在字符串的引号，不在字符串中为 0
+    char in_comment;   // 是否在多行注释中
+    char line_comment; // 是否在单行注释中，到行尾都是注释
+    char prev_sep;     // 前一个字符是否为分隔符
+    char prev_num;     // 前一个字符是否高亮为数字
+};
+
 struct editorSyntax
 {
     char *filetype;
@@ -63,35 +189,427 @@ struct editorSyntax
     char *multiline_comment_start;
     char *multiline_comment_end;
     int flags; // flag 包含该文件类型要突出显示哪些内容的标志
+    struct syntaxtable *tab; // 编译后的关键字表和分类表，定义中写 NULL
+};
+
+// 高亮区间：从 start 开始的 len 个字符都是 type
+typedef struct hlspan
+{
+    unsigned int start;
+    unsigned int len;
+    unsigned char type;
+} hlspan;
+
+// 高亮结果按区间写出，HL_NORMAL 的部分不保存，超出 unsigned int 范围的部分不高亮
+// 扩容失败时 err 置 1，之后的区间丢弃，状态照常计算
+struct hlsink
+{
+    hlspan *spans;
+    size_t n;
+    size_t cap;
+    size_t pos;         // spans 已经写到的位置
+    unsigned char type; // 从 pos 开始还没写入 spans 的一段：类型和长度
+    size_t len;
+    int err;
 };
 
 // Editor Row
 typedef struct erow
 {
-    int idx;
-    int size;
-    int rsize;
+    size_t size;
+    size_t rsize; // render 的长度，生成时和 size 相同
+    // chars 是间隙缓冲区：内容是 [0, gap) 和 [gap + gaplen, size + gaplen) 两段
+    // 间隙跟随光标移动，连续输入和删除不需要搬动整行
     char *chars;
-    char *render;
-    unsigned char *hl;
-    int hl_open_comment;
+    size_t gap;
+    size_t gaplen;
+    char *render; // 行内容的连续视图，不展开 tab，可能和 chars 共用内存
+    hlspan *hl; // 按位置排序的高亮区间，HL_NORMAL 的部分不保存
+    size_t nhl;
+    int hl_state; // 这一行结束时高亮 DFA 的状态，也是下一行开始时的状态
+    int mapped; // chars 是文件映射中的只读视图，修改前需要复制
 } erow;
 
+// 行树节点，所有行按行号顺序存放在一棵隐式 treap 中
+// 子树行数用于按行号定位，插入、删除、跳转到指定行都是 O(log n)
+typedef struct rownode
+{
+    erow row; // 必须是第一个成员，erow 指针和节点指针可以直接转换
+    struct rownode *left, *right, *parent;
+    unsigned int prio;
+    unsigned int flat; // 子树中都是映射中首尾相接的原始行，可以当作一整块内存查找；也可能是 ROW_FLAT_UNKNOWN
+    size_t count;      // 子树中的行数
+} rownode;
+
+// 行存储的大块，从中顺序切出行节点数组和各个分级的内存块
+struct arenaslab
+{
+    struct arenaslab *next;
+    size_t used, cap;
+    char data[];
+};
+
+// 超过最大分级的内存单独申请，挂在双向链表上以便整体释放
+struct arenabig
+{
+    struct arenabig *prev, *next;
+    size_t size;
+    char data[];
+};
+
+// 行存储：节点、chars、render、hl 都从这里分配，关闭文档时一次释放
+struct editorArena
+{
+    struct arenaslab *slabs; // 第一个是正在切分的大块
+    struct arenabig *big;
+    void *pool[EDITOR_ARENA_CLASSES]; // 每个分级中释放后可复用的内存块
+    rownode *nodes;                   // 释放后可复用的行节点
+    size_t used;                      // 正在使用的字节数
+    size_t reserved;                  // 向系统申请的字节数
+    size_t nslabs, nbig;
+};
+
+// 保存快照中复制出来的行数据
+struct saveblock
+{
+    struct saveblock *next;
+    size_t used, cap;
+    char data[];
+};
+
+// 后台保存任务，工作线程只读取快照，不访问行树
+struct editorSaveJob
+{
+    int active; // 只由主线程读写
+    pthread_t thread;
+    pthread_mutex_t lock; // 保护 written、done、err、map
+    struct iovec *segs;   // 快照：按顺序写出的片段
+    int nsegs, segcap;
+    struct saveblock *blocks; // 修改过的行的副本
+    char *path;
+    int dirty; // 拍快照时的 E.dirty
+    size_t total;
+    size_t written;
+    int done;
+    int err;   // 失败时的 errno
+    char *map; // 成功时新文件的映射
+    int inplace; // 目标有多个硬链接：不 rename，写好临时文件后再复制回原文件
+    char *tmp;   // 原地保存时留下的临时文件，复制完成后删除
+    struct timespec start;
+};
+
+// 后台加载线程切分出的一批行，ends 是每行结尾（换行符或文件末尾）在映射中的位置
+// ends 指向 buf 或者整个文件的行索引中的一段
+struct loadbatch
+{
+    struct loadbatch *next;
+    size_t n;
+    const size_t *ends;
+    size_t buf[];
+};
+
+// 并行建立行索引时文件被切成的一段
+struct indexchunk
+{
+    size_t start, end; // 在映射中的范围
+    size_t count;      // 段内换行符的个数
+    size_t base;       // 之前各段换行符个数之和，即段内第一个换行符在行索引中的位置
+    int done;          // 第二遍已经填好这一段
+};
+
+// 三元组索引：映射按 EDITOR_TRIGRAM_BLOCK 字节分块，每块用位图记下其中开始的三元组（忽略大小写后散列）
+// 映射的内容不会改变，修改过的行已经复制到映射之外，查找时总是直接扫描，所以编辑时索引不需要更新
+struct editorTrigram
+{
+    int active; // 还在建立，只由主线程读写
+    int ready;  // 索引可用，只在没有查找线程时由主线程修改
+    pthread_t threads[EDITOR_INDEX_THREADS];
+    int nthreads;
+    pthread_mutex_t lock; // 保护 next、built、cancel
+    const char *map;
+    size_t len;
+    uint64_t *bits; // 第 b 块的位图从 bits[b << (EDITOR_TRIGRAM_SHIFT - 6)] 开始
+    unsigned char fold[256]; // 查表转为小写比逐字节判断快
+    size_t nblocks;
+    size_t next;  // 下一个待建立的块
+    size_t built; // 已经建好的块数
+    int cancel;
+    double start, time; // 建立用时，显示在统计信息中
+};
+
+// 后台加载：工作线程在映射中查找换行符，主线程按批把行接到行树末尾
+struct editorLoader
+{
+    int active; // 只由主线程读写
+    pthread_t thread;
+    pthread_mutex_t lock;          // 保护 head、tail、done、nextchunk、chunks[].done
+    pthread_cond_t cond;           // 有新的批次、有段填写完成或者加载结束
+    struct loadbatch *head, *tail; // 加载线程已经切分好的批次
+    const char *map;
+    size_t len;
+    int done;
+    struct indexchunk *chunks; // 并行建立行索引
+    size_t nchunks;
+    size_t nextchunk; // 下一个待扫描的段
+    int pass;         // 1 统计换行符个数，2 填写换行符位置
+    size_t *index;    // 换行符在映射中的位置，按前缀和拼接成一个数组
+    struct loadbatch *pending, *pendtail; // 主线程：取出后还没接入行树的批次
+    size_t next;                          // 主线程：下一行在映射中的起始位置
+    size_t lines;                         // 主线程：已经接入行树的文件行数，加载期间的编辑不影响它
+    struct editorCache *cache;            // 扫描完成后写入的缓存，为 NULL 时不写
+    const size_t *cached;                 // 缓存中的行结尾位置，不为 NULL 时不扫描文件
+    size_t ncached;
+};
+
+// 行索引缓存文件头，后面依次是被缓存文件的路径（补齐到 8 字节）、
+// nlines 个行结尾位置和 nlines 个 uint16_t 的行结束时高亮状态，其中前 nstates 个有效
+struct cacheheader
+{
+    char magic[8];
+    uint64_t size; // 被缓存文件的大小、修改时间、设备号、inode 和抽样内容的散列
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t sample;
+    uint64_t nlines;
+    uint64_t nstates;
+    uint64_t syntax; // 生成高亮状态的 DFA 的指纹
+    uint64_t pathlen;
+};
+
+// 行索引缓存，按路径保存在 ~/.cache/kilo 中，文件没有变化时重新打开直接使用缓存的
+// 行索引和各行的高亮状态，不再扫描文件
+struct editorCache
+{
+    char *path;             // 缓存文件，为 NULL 时不使用缓存
+    char *file;             // 被缓存文件的绝对路径
+    struct cacheheader hdr; // 按当前文件算出的文件头
+    char *map;              // 有效的缓存文件映射
+    size_t mapsize;
+    const size_t *ends;       // 缓存的行结尾位置，共 hdr.nlines 个
+    const uint16_t *states;   // 缓存的各行高亮状态，共 hdr.nstates 个
+    int warm;                 // 本次打开使用了缓存
+    double start, opentime;   // 开始打开文件的时刻和加载完成所用的时间
+};
+
+// 正则表达式语法树的节点类型
+enum rxasttype
+{
+    RXA_EMPTY,
+    RXA_SET,
+    RXA_CAT,
+    RXA_ALT,
+    RXA_REPEAT,
+    RXA_BOL,
+    RXA_EOL
+};
+
+// NFA 节点：RX_START/RX_END 是读取方向上的行首/行尾断言，反向读取时 ^ 和 $ 互换
+enum rxop
+{
+    RX_SET,
+    RX_SPLIT,
+    RX_START,
+    RX_END,
+    RX_MATCH
+};
+
+struct rxnode
+{
+    unsigned char op;
+    int set; // RX_SET 的字节集合
+    int out, out1;
+};
+
+// 编译好的 NFA，只读，可以在线程间共享
+struct regexprog
+{
+    struct rxnode *nodes;
+    int nnodes;
+    unsigned char (*sets)[32]; // 字节集合的位图
+    int nsets;
+    int rstart; // 反向读取的入口，可以先跳过任意字节
+    int astart; // 正向读取的入口，从匹配的起点开始
+    char *lit;  // 每个匹配都包含的字面串，没有时为 NULL
+};
+
+// 惰性 DFA 的状态：对应的 NFA 节点集合在 pool 中，转移用到时才计算
+struct rxstate
+{
+    int off, n;
+    unsigned char accept;    // 读到这里就是一个匹配
+    unsigned char endaccept; // 如果这里是行尾就是一个匹配
+};
+
+struct regexdfa
+{
+    int entry; // NFA 的入口
+    struct rxstate *states;
+    int nstates;
+    int *next; // 状态 s 读入字节 c 后的状态在 next[s * 256 + c]，存的是状态编号乘以 256，-1 表示还没有计算
+    int *pool;
+    size_t npool, poolcap;
+    int *hash; // NFA 节点集合到状态的开放寻址散列表
+    size_t hashmask;
+    int start[2]; // 不在行首和在行首开始时的状态
+    unsigned int flushes;
+};
+
+// 正则表达式匹配器：共用只读的 prog，DFA 缓存和临时数组每个线程一份
+struct regex
+{
+    struct regexprog *prog;
+    int owner; // prog 由这一份释放
+    struct regexdfa rev, fwd;
+    int *stack, *list, *ids, *tmp;
+    unsigned int *mark, gen;
+    size_t *starts; // regexStarts() 找到的起点
+    size_t startcap;
+};
+
+// 编译好的查询：忽略大小写时 s 是小写的，比较首尾字节前先或上 firstfold/lastfold
+struct searchquery
+{
+    char *s;
+    size_t len;
+    int icase; // 忽略大小写（只限 ASCII 字母）
+    int word;  // 整词匹配：匹配前后都不能是单词中的字节
+    int regex; // s 是正则表达式，由 re 匹配
+    struct regex *re;
+    struct searchquery *must; // 正则表达式的字面串，先用它筛选可能有匹配的行
+    const char *error; // 正则表达式的错误
+    uint32_t tri[EDITOR_TRIGRAM_OVERLAP]; // 字面串的三元组在索引位图中的位置
+    int ntri;
+    unsigned char first, last;
+    unsigned char firstfold, lastfold;
+};
+
+struct searchmatch
+{
+    size_t y, x;
+};
+
+// 一行中匹配的一段
+struct matchspan
+{
+    size_t at, len;
+};
+
+// 一行中所有匹配的位置，查找时绘制在语法高亮之上
+// 第 y 行缓存在 E.matchcache[y % EDITOR_MATCH_CACHE] 中，连续的可见行不会互相挤占
+struct matchline
+{
+    erow *row;        // 为 NULL 时空闲
+    unsigned version; // 查询的版本，查询变化后缓存的位置作废
+    struct matchspan *spans;
+    size_t nspans, cap;
+};
+
+// 屏幕上的一格
+struct screencell
+{
+    char c;
+    signed char color; // editorSyntaxToColor() 返回的 SGR 参数，-1 为默认颜色
+};
+
+// 终端上现在的画面，新画面只输出和它不同的格子
+struct editorFrame
+{
+    struct screencell *shown; // 已经输出到终端的画面
+    struct screencell *next;  // 正在生成的画面
+    int rows, cols;
+    int valid;            // shown 和终端上的内容一致，为 0 时整屏重画
+    int cy, cx;           // 终端光标的位置，cy 为 -1 表示不确定
+    size_t rowoff, coloff; // shown 中文本的滚动位置
+    size_t lastbytes;     // 上一帧输出的字节数
+    size_t bytes, frames; // 累计输出的字节数和帧数，显示在统计信息中
+};
+
+// 查找提示的状态和后台查找线程
+// 查找期间不会修改行，线程直接读取行树；开始之前主线程先确认 flat 标记并去掉自己持有的行中的间隙
+struct editorSearch
+{
+    struct searchquery q;
+    char *text;                // 当前查询的原文
+    int icase, word, regex;    // 提示中切换的选项，下次查找时保留
+    size_t origin_y, origin_x; // 打开查找时的光标位置，查询变化后从这里开始找
+    size_t target_y, target_x; // 还没有跳到匹配时，跳到这里之后的第一个匹配
+    int found;                 // 是否有当前匹配，位置是第 y 行第 x 列
+    size_t y, x;
+    char prompt[160];
+    int active; // 只由主线程读写
+    pthread_t thread;
+    int threaded;                // 查找在线程中进行，结束时需要回收；为 0 时已经在主线程中查找完
+    pthread_mutex_t lock;        // 保护 matches、nmatches、matchcap、total、done、cancel
+    struct searchmatch *matches; // 按位置排序的匹配，最多保存 EDITOR_FIND_MAX_MATCHES 个
+    size_t nmatches, matchcap;
+    size_t total; // 已经找到的匹配数
+    unsigned version; // 查询每次变化时加一
+    int done;
+    int cancel;   // 主线程要求线程尽快结束
+    size_t shown; // 提示中显示的匹配数
+    size_t bytes; // 线程扫描的字节数和用时，线程结束后计入统计
+    double time;
+};
+
+// 并行高亮时的一段连续的行
+struct hlchunk
+{
+    erow *first;
+    size_t n;
+    int entry;    // 推测的进入状态
+    int exit;     // 按推测的进入状态算出的结束状态
+    size_t bytes;
+};
+
+// 并行高亮任务，工作线程按顺序领取各段
+struct hljob
+{
+    pthread_mutex_t lock; // 保护 next
+    struct hlchunk *chunks;
+    size_t nchunks;
+    size_t next;
+};
+
 struct editorConfig
 {
-    int cx, cy; // 光标位置
-    int rx;     // 实际渲染的光标 x 位置
-    int rowoff; // 行偏移量
-    int coloff; // 列偏移量
+    size_t cx, cy; // 光标位置
+    size_t rx;     // 实际渲染的光标 x 位置
+    size_t rowoff; // 行偏移量
+    size_t coloff; // 列偏移量
     int screenrows;
     int screencols;
-    int numrows;
-    erow *row;
+    size_t numrows;
+    rownode *rowroot;  // 行树的根
+    size_t rowops;     // 插入删除行的次数和行树操作的总耗时，显示在统计信息中
+    double rowtime;
+    size_t hlbytes;    // 语法高亮处理过的字节数和总耗时，显示在统计信息中
+    double hltime;
+    size_t hlvalid;    // 前 hlvalid 行结束时的高亮状态是可靠的
+    struct editorArena arena;
+    size_t reslo, reshi; // 持有 render/hl 的行所在范围 [reslo, reshi)
+    erow *match_row;     // 搜索匹配所在的行，绘制时覆盖在语法高亮之上
+    size_t match_start, match_len;
+    struct editorSearch search;
+    struct matchline *matchcache; // 可见行中的匹配，第一次查找时分配
+    size_t matchscans;            // 为绘制匹配扫描过的行数，显示在统计信息中
+    size_t findbytes; // 查找扫描过的字节数和总耗时，显示在统计信息中
+    double findtime;
+    char *map;        // 文件内容映射，mapped 行指向其中
+    size_t mapsize;
     int dirty;
+    struct editorSaveJob save;
+    struct editorLoader loader;
+    struct editorCache cache;
+    struct editorTrigram trigram;
     char *filename;
+    struct editorFrame frame;
     char statusmsg[80];
     time_t statusmsg_time;
     struct editorSyntax *syntax;
+    struct editorSyntax *syntaxdb; // 所有文件类型：从文件加载的在前，内置的 HLDB 在后
+    size_t nsyntax;
     struct termios orig_termios; // 终端初始属性
 };
 
@@ -137,22 +655,26 @@ struct editorSyntax HLDB[] = {
      C_HL_extensions,
      C_HL_keywords,
      "//", "/*", "*/",
-     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
+     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+     NULL},
     {"Golang",
      GO_HL_extensions,
      GO_HL_keywords,
      "//", "/*", "*/",
-     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
+     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+     NULL},
     {"Python",
      PYTHON_HL_extensions,
      PYTHON_HL_keywords,
      "#", NULL, NULL,
-     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS},
+     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+     NULL},
     {"Shell",
      SHELL_HL_extensions,
      SHELL_HL_keywords,
      "#", NULL, NULL,
-     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS}};
+     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+     NULL}};
 
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0])) // HLDB 数组长度
 
@@ -160,7 +682,18 @@ struct editorSyntax HLDB[] = {
 
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
-char *editorPrompt(char *prompt, void (*callback)(char *, int));
+char *editorPrompt(char *prompt, void (*callback)(char *, int), int allowempty);
+int editorPollBackground();
+void editorLoadUntil(size_t nrows);
+erow *editorRowAt(size_t at);
+erow *editorRowNext(erow *row);
+erow *editorRowPrev(erow *row);
+int editorRowDepth(erow *row);
+char *editorRowLinear(erow *row);
+double editorNow();
+int writevAll(int fd, struct iovec *iov, int iovcnt);
+unsigned char searchFold(unsigned char c);
+void editorMatchForget(erow *row, size_t at);
 
 /*** terminal ***/
 
@@ -212,6 +745,9 @@ int editorReadKey()
     {
         if (nread == -1 && errno != EAGAIN)
             die("read"); // Cygwin 中 read() 超时还会返回 errno 为 EAGAIN
+        // read() 超时说明没有输入，顺便处理后台任务
+        if (editorPollBackground())
+            editorRefreshScreen();
     }
 
     // 对方向键映射为光标控制键
@@ -339,624 +875,5159 @@ int getWindowSize(int *rows, int *cols)
     }
 }
 
-/*** syntax highlighting ***/
+/*** row storage ***/
 
-int is_separator(int c)
+size_t editorArenaClass(size_t size)
 {
-    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+    size_t c = 0;
+    while ((size_t)EDITOR_ARENA_MIN << c < size)
+        c++;
+    return c;
 }
 
-void editorUpdateSyntax(erow *row)
+// 申请 size 字节时实际得到的大小，调用者可以用满
+size_t editorArenaSize(size_t size)
 {
-    // hl 和 rsize 一样大
-    row->hl = realloc(row->hl, row->rsize);
-    memset(row->hl, HL_NORMAL, row->rsize);
-
-    // 没有文件类型，不更新高亮
-    if (E.syntax == NULL)
-        return;
-
-    char **keywords = E.syntax->keywords;
-
-    // 是否有单行注释开始符
-    char *scs = E.syntax->singleline_comment_start;
-    char *mcs = E.syntax->multiline_comment_start;
-    char *mce = E.syntax->multiline_comment_end;
-
-    int scs_len = scs ? strlen(scs) : 0;
-    int mcs_len = mcs ? strlen(mcs) : 0;
-    int mce_len = mce ? strlen(mce) : 0;
-
-    int prev_sep = 1;                                                       // 前一个字符是否为分隔符
-    int in_string = 0;                                                      // 当前是否在字符串中
-    int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment); // 是否在多行注释中
+    if (size > EDITOR_ARENA_MAX)
+        return size;
+    return (size_t)EDITOR_ARENA_MIN << editorArenaClass(size);
+}
 
-    int i = 0;
-    while (i < row->rsize)
+// 从大块中顺序切出 size 字节，不单独释放
+void *editorArenaBulk(size_t size)
+{
+    struct editorArena *A = &E.arena;
+    size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    struct arenaslab *s = A->slabs;
+    if (s == NULL || s->cap - s->used < size)
     {
-        char c = row->render[i];
-        // prev_hl 设置为前一个字符串的突出显示类型
-        unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
-
-        // 文件类型存在单行注释高亮且此时不在字符串和多行注释中
-        if (scs_len && !in_string && !in_comment)
-        {
-            if (!strncmp(&row->render[i], scs, scs_len))
-            {
-                // 将整行其余部分高亮
-                memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-                break;
-            }
-        }
-
-        // 文件类型存在多行注释且当前不在字符串中
-        if (mcs_len && mce_len && !in_string)
-        {
-            if (in_comment)
-            {
-                row->hl[i] = HL_MLCOMMENT;
-                // 是否处于多行注释末尾
-                if (!strncmp(&row->render[i], mce, mce_len))
-                {
-                    memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-                    i += mce_len;
-                    in_comment = 0;
-                    prev_sep = 1;
-                    continue;
-                }
-                else
-                {
-                    i++;
-                    continue;
-                }
-            }
-            // 是否处于多行注释开头
-            else if (!strncmp(&row->render[i], mcs, mcs_len))
-            {
-                memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-                i += mcs_len;
-                in_comment = 1;
-                continue;
-            }
-        }
-
-        // 检查是否突出显示当前文件类型的字符串
-        if (E.syntax->flags & HL_HIGHLIGHT_STRINGS)
-        {
-            if (in_string)
-            {
-                row->hl[i] = HL_STRING;
-                // 突出显示反斜杠后面的字符
-                if (c == '\\' && i + 1 < row->rsize)
-                {
-                    row->hl[i] = HL_STRING;
-                    i += 2;
-                    continue;
-                }
-                // 在字符串中时，遇到 " 或 ' 说明结束字符串
-                if (c == in_string)
-                    in_string = 0;
-                i++;
-                prev_sep = 1; // 结束引号视为分隔符
-                continue;
-            }
-            else
-            {
-                if (c == '"' || c == '\'')
-                {
-                    in_string = c; // 设置为字符串开始/结束字符
-                    row->hl[i] = HL_STRING;
-                    i++;
-                    continue;
-                }
-            }
-        }
-
-        // 检查是否突出显示当前文件类型的数字
-        if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS)
+        size_t cap = size > EDITOR_ARENA_SLAB ? size : EDITOR_ARENA_SLAB;
+        struct arenaslab *n = malloc(sizeof(struct arenaslab) + cap);
+        if (n == NULL)
+            die("malloc");
+        n->used = 0;
+        n->cap = cap;
+        // 特别大的请求单独占一块，不打断当前大块的切分
+        if (s && cap > EDITOR_ARENA_SLAB)
         {
-            // 要突出显示数字，前一个字符为分隔符或者也是突出显示的数字，包含小数点的数字也考虑
-            if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
-                (c == '.' && prev_hl == HL_NUMBER))
-            {
-                row->hl[i] = HL_NUMBER;
-                i++;
-                prev_sep = 0;
-                continue;
-            }
+            n->next = s->next;
+            s->next = n;
         }
-
-        // 关键词需要有分隔符
-        if (prev_sep)
+        else
         {
-            int j;
-            for (j = 0; keywords[j]; j++)
-            {
-                int klen = strlen(keywords[j]);
-                int kw2 = keywords[j][klen - 1] == '|';
-                if (kw2)
-                    klen--;
-
-                // 关键词之后也要有分隔符
-                if (!strncmp(&row->render[i], keywords[j], klen) &&
-                    is_separator(row->render[i + klen]))
-                {
-                    memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-                    i += klen;
-                    break;
-                }
-            }
-            if (keywords[j] != NULL)
-            {
-                prev_sep = 0;
-                continue;
-            }
+            n->next = s;
+            A->slabs = n;
         }
-
-        // 如果没有突出显示当前字符
-        prev_sep = is_separator(c);
-        i++;
+        A->reserved += cap;
+        A->nslabs++;
+        s = n;
     }
-
-    int changed = (row->hl_open_comment != in_comment);
-    row->hl_open_comment = in_comment; // 该行是否以未闭合的多行注释结束
-    if (changed && row->idx + 1 < E.numrows)
-        editorUpdateSyntax(&E.row[row->idx + 1]);
+    void *p = &s->data[s->used];
+    s->used += size;
+    A->used += size;
+    return p;
 }
 
-int editorSyntaxToColor(int hl)
+// 按分级分配，释放时必须传入同样的 size
+// 单独申请的大块失败时返回 NULL，调用者可以放弃这次操作而不退出
+void *editorArenaTryAlloc(size_t size)
 {
-    switch (hl)
+    struct editorArena *A = &E.arena;
+    if (size > EDITOR_ARENA_MAX)
     {
-    case HL_COMMENT:
-    case HL_MLCOMMENT:
-        return 36; // 青色
-    case HL_KEYWORD1:
-        return 33; // 黄色
-    case HL_KEYWORD2:
-        return 32; // 绿色
-    case HL_STRING:
-        return 35; // 洋红色
-    case HL_NUMBER:
-        return 31; // 红色
-    case HL_MATCH:
-        return 34; // 蓝色
-    default:
-        return 37;
+        struct arenabig *b = malloc(sizeof(struct arenabig) + size);
+        if (b == NULL)
+            return NULL;
+        b->size = size;
+        b->prev = NULL;
+        b->next = A->big;
+        if (A->big)
+            A->big->prev = b;
+        A->big = b;
+        A->reserved += size;
+        A->used += size;
+        A->nbig++;
+        return b->data;
     }
+    size_t c = editorArenaClass(size);
+    void *p = A->pool[c];
+    if (p == NULL)
+        return editorArenaBulk((size_t)EDITOR_ARENA_MIN << c);
+    A->pool[c] = *(void **)p;
+    A->used += (size_t)EDITOR_ARENA_MIN << c;
+    return p;
 }
 
-void editorSelectSyntaxHighlight()
+void *editorArenaAlloc(size_t size)
 {
-    E.syntax = NULL;
-    if (E.filename == NULL)
-        return;
-
-    char *ext = strrchr(E.filename, '.'); // 返回指向字符串中最后一个字符出现的指针
-
-    for (unsigned int j = 0; j < HLDB_ENTRIES; j++)
-    {
-        struct editorSyntax *s = &HLDB[j];
-        unsigned int i = 0;
-        while (s->filematch[i])
-        {
-            int is_ext = (s->filematch[i][0] == '.'); // 是否有拓展名
-            // 检查文件类型是否与高亮数据库中的匹配，有拓展名比较拓展名，无拓展名比较文件名
-            if ((is_ext && ext && !strcmp(ext, s->filematch[i])) || (!is_ext && strstr(E.filename, s->filematch[i])))
-            {
-                E.syntax = s;
-
-                // 确保文件类型更改时 (open, save) 突出显示立即更改
-                int filerow;
-                for (filerow = 0; filerow < E.numrows; filerow++)
-                {
-                    editorUpdateSyntax(&E.row[filerow]);
-                }
-                return;
-            }
-            i++;
-        }
-    }
+    void *p = editorArenaTryAlloc(size);
+    if (p == NULL)
+        die("malloc");
+    return p;
 }
 
-/*** row operations ***/
-
-int editorRowCxToRx(erow *row, int cx)
+void editorArenaFree(void *p, size_t size)
 {
-    int rx = 0;
-    int j;
-    for (j = 0; j < cx; j++)
+    struct editorArena *A = &E.arena;
+    if (p == NULL)
+        return;
+    if (size > EDITOR_ARENA_MAX)
     {
-        if (row->chars[j] == '\t')
-            // 到达下一个制表位
-            rx += (EDITOR_TAB_STOP - 1) - (rx % EDITOR_TAB_STOP);
-        rx++;
+        struct arenabig *b = (struct arenabig *)((char *)p - offsetof(struct arenabig, data));
+        if (b->prev)
+            b->prev->next = b->next;
+        else
+            A->big = b->next;
+        if (b->next)
+            b->next->prev = b->prev;
+        A->reserved -= b->size;
+        A->used -= b->size;
+        A->nbig--;
+        free(b);
+        return;
     }
-    return rx;
+    // 放回所属分级，下次同级申请时复用
+    size_t c = editorArenaClass(size);
+    *(void **)p = A->pool[c];
+    A->pool[c] = p;
+    A->used -= (size_t)EDITOR_ARENA_MIN << c;
 }
 
-int editorRowRxToCx(erow *row, int rx)
+void *editorArenaRealloc(void *p, size_t old, size_t size)
 {
-    int cur_rx = 0;
-    int cx;
-    // 边遍历边计算 rx，当计算出的 rx 和 给定 rx 相同时，返回此时 cx
-    for (cx = 0; cx < row->size; cx++)
+    if (p && editorArenaSize(old) == editorArenaSize(size) && size <= EDITOR_ARENA_MAX)
+        return p;
+    void *n = editorArenaAlloc(size);
+    if (p)
     {
-        if (row->chars[cx] == '\t')
-            cur_rx += (EDITOR_TAB_STOP - 1) - (cur_rx % EDITOR_TAB_STOP);
-        cur_rx++;
-
-        if (cur_rx > rx)
-            return cx;
+        memcpy(n, p, old < size ? old : size);
+        editorArenaFree(p, old);
     }
-    return cx;
+    return n;
 }
 
-void editorUpdateRow(erow *row)
+rownode *editorArenaNode()
 {
-    // 由于 tab 转换为 8 个空格，申请的内存空间也要增大
-    int tabs = 0;
-    int j;
-    for (j = 0; j < row->size; j++)
-        if (row->chars[j] == '\t')
-            tabs++;
+    struct editorArena *A = &E.arena;
+    rownode *n = A->nodes;
+    if (n == NULL)
+        return editorArenaBulk(sizeof(rownode));
+    A->nodes = n->right;
+    A->used += sizeof(rownode);
+    return n;
+}
 
-    free(row->render);
-    row->render = malloc(row->size + tabs * (EDITOR_TAB_STOP - 1) + 1);
+// 节点可能位于批量分配的数组中，只能放回节点池复用
+void editorArenaFreeNode(rownode *n)
+{
+    struct editorArena *A = &E.arena;
+    n->right = A->nodes;
+    A->nodes = n;
+    A->used -= sizeof(rownode);
+}
 
-    // 复制字符串
-    int idx = 0;
-    for (j = 0; j < row->size; j++)
+// 一次释放所有行存储
+void editorArenaRelease()
+{
+    struct editorArena *A = &E.arena;
+    while (A->slabs)
     {
-        // 将 tab 转换为 8 个空格
-        if (row->chars[j] == '\t')
-        {
-            // 每个制表符必须让光标向前移动至少一列
-            row->render[idx++] = ' ';
-            // 到达制表位
-            while (idx % EDITOR_TAB_STOP != 0)
-                row->render[idx++] = ' ';
-        }
-        else
-        {
-            row->render[idx++] = row->chars[j];
-        }
+        struct arenaslab *next = A->slabs->next;
+        free(A->slabs);
+        A->slabs = next;
     }
-    row->render[idx] = '\0';
-    row->rsize = idx;
-
-    editorUpdateSyntax(row);
+    while (A->big)
+    {
+        struct arenabig *next = A->big->next;
+        free(A->big);
+        A->big = next;
+    }
+    memset(A, 0, sizeof(*A));
 }
 
-void editorInsertRow(int at, char *s, size_t len)
+// 在状态栏显示统计信息，一页放不下，统计信息还显示着时再按 Ctrl-T 显示下一页
+// 1 行数、映射大小和打开用时，2 行存储的内存使用情况和光标所在行在行树中的深度，
+// 3 插入删除行的平均耗时和语法高亮、查找的速度，4 三元组索引的建立用时、匹配缓存重新扫描的行数和每帧输出的字节数
+void editorShowStats()
 {
-    if (at < 0 || at > E.numrows)
-        return;
+    static int page;
+    if (strncmp(E.statusmsg, "stats ", 6) == 0 && time(NULL) - E.statusmsg_time < 5)
+        page = (page + 1) % EDITOR_STATS_PAGES;
+    else
+        page = 0;
 
-    // 重新分配增加一行之后的内存
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    // 后面所有行向后移动，腾出新行位置
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-    for (int j = at + 1; j <= E.numrows; j++)
-        E.row[j].idx++;
+    struct editorArena *A = &E.arena;
+    erow *row;
+    switch (page)
+    {
+    case 0:
+        editorSetStatusMessage("stats 1/%d: %zu rows | map %.1f MB | open %.3f s %s",
+                               EDITOR_STATS_PAGES, E.numrows, E.mapsize / 1048576.0,
+                               E.cache.opentime, E.cache.warm ? "warm" : "cold");
+        break;
+    case 1:
+        row = editorRowAt(E.cy);
+        editorSetStatusMessage("stats 2/%d: arena %.1f/%.1f MB (%zu slabs, %zu large) | depth %d",
+                               EDITOR_STATS_PAGES, A->used / 1048576.0, A->reserved / 1048576.0,
+                               A->nslabs, A->nbig, row ? editorRowDepth(row) : 0);
+        break;
+    case 2:
+        editorSetStatusMessage("stats 3/%d: row ins/del %.2f us x%zu | hl %.1f MB/s | find %.2f GB/s",
+                               EDITOR_STATS_PAGES, E.rowops ? E.rowtime * 1e6 / E.rowops : 0.0, E.rowops,
+                               E.hltime > 0 ? E.hlbytes / E.hltime / 1048576.0 : 0.0,
+                               E.findtime > 0 ? E.findbytes / E.findtime / 1073741824.0 : 0.0);
+        break;
+    default:
+        editorSetStatusMessage("stats 4/%d: trigram %.2f s | match rows %zu | frame %zu B avg %.0f B",
+                               EDITOR_STATS_PAGES, E.trigram.time, E.matchscans, E.frame.lastbytes,
+                               E.frame.frames ? (double)E.frame.bytes / E.frame.frames : 0.0);
+        break;
+    }
+}
 
-    E.row[at].idx = at;
+/*** row tree ***/
 
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    // 将给定字符串复制到新行
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
+size_t rowCount(rownode *t)
+{
+    return t ? t->count : 0;
+}
+
+rownode *rowFirst(rownode *t)
+{
+    while (t->left)
+        t = t->left;
+    return t;
+}
+
+rownode *rowLast(rownode *t)
+{
+    while (t->right)
+        t = t->right;
+    return t;
+}
+
+// 两个映射中的行是否首尾相接：a 的内容之后只有回车和一个换行，接着就是 b
+int rowAdjacent(erow *a, erow *b)
+{
+    if (!a->mapped || !b->mapped)
+        return 0;
+    const char *p = a->chars + a->size;
+    if (b->chars <= p || b->chars[-1] != '\n')
+        return 0;
+    while (p < b->chars - 1 && *p == '\r')
+        p++;
+    return p == b->chars - 1;
+}
+
+// 重新计算子树行数并修正子节点的父指针
+// flat 只记下子树可能是整块的，需要时再由 rowFlat() 确认，插入删除时不必沿子树的边界下行
+void rowPull(rownode *t)
+{
+    t->count = 1 + rowCount(t->left) + rowCount(t->right);
+    t->flat = t->row.mapped ? ROW_FLAT_UNKNOWN : 0;
+    if (t->left)
+    {
+        t->left->parent = t;
+        if (!t->left->flat)
+            t->flat = 0;
+    }
+    if (t->right)
+    {
+        t->right->parent = t;
+        if (!t->right->flat)
+            t->flat = 0;
+    }
+}
+
+// 确认子树是否 flat，结果记在节点中，直到子树再次变化
+int rowFlat(rownode *t)
+{
+    if (t->flat == ROW_FLAT_UNKNOWN)
+        t->flat = (t->left == NULL || (rowFlat(t->left) && rowAdjacent(&rowLast(t->left)->row, &t->row))) &&
+                  (t->right == NULL || (rowFlat(t->right) && rowAdjacent(&t->row, &rowFirst(t->right)->row)));
+    return t->flat;
+}
+
+// 行的内容变化后，重新计算它和所有祖先节点
+void rowPullUp(erow *row)
+{
+    rownode *t;
+    for (t = (rownode *)row; t; t = t->parent)
+        rowPull(t);
+}
+
+unsigned int rowRandom()
+{
+    static unsigned int x = 2463534242u;
+    // xorshift32
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+// 将 t 分为前 k 行 *a 和其余行 *b
+void rowSplit(rownode *t, size_t k, rownode **a, rownode **b)
+{
+    if (t == NULL)
+    {
+        *a = *b = NULL;
+        return;
+    }
+    if (rowCount(t->left) < k)
+    {
+        rowSplit(t->right, k - rowCount(t->left) - 1, &t->right, b);
+        *a = t;
+    }
+    else
+    {
+        rowSplit(t->left, k, a, &t->left);
+        *b = t;
+    }
+    rowPull(t);
+}
+
+// 将 b 的所有行接在 a 之后
+rownode *rowMerge(rownode *a, rownode *b)
+{
+    if (a == NULL)
+        return b;
+    if (b == NULL)
+        return a;
+    if (a->prio > b->prio)
+    {
+        a->right = rowMerge(a->right, b);
+        rowPull(a);
+        return a;
+    }
+    b->left = rowMerge(a, b->left);
+    rowPull(b);
+    return b;
+}
+
+void rowTreeSetRoot(rownode *t)
+{
+    E.rowroot = t;
+    if (t)
+        t->parent = NULL;
+}
+
+void rowTreeInsert(size_t at, rownode *n)
+{
+    rownode *a, *b;
+    n->left = n->right = n->parent = NULL;
+    n->prio = rowRandom();
+    rowPull(n);
+    rowSplit(E.rowroot, at, &a, &b);
+    rowTreeSetRoot(rowMerge(rowMerge(a, n), b));
+}
+
+rownode *rowTreeRemove(size_t at)
+{
+    rownode *a, *b, *m;
+    rowSplit(E.rowroot, at, &a, &b);
+    rowSplit(b, 1, &m, &b);
+    rowTreeSetRoot(rowMerge(a, b));
+    return m;
+}
+
+// 自底向上重新计算整棵子树的行数和父指针，递归深度等于树高
+void rowPullTree(rownode *t)
+{
+    if (t == NULL)
+        return;
+    rowPullTree(t->left);
+    rowPullTree(t->right);
+    rowPull(t);
+}
+
+// 由按行号排列的节点数组直接构造子树，O(n)
+// 每个节点取随机优先级，按笛卡尔树的方式建树：栈中保存当前的右链
+// 得到的树和逐个随机插入的 treap 分布相同，多批依次合并后整棵树的期望深度仍是 O(log n)
+rownode *rowTreeBuild(rownode *nodes, size_t n)
+{
+    if (n == 0)
+        return NULL;
+    rownode **stack = malloc(sizeof(rownode *) * n);
+    if (stack == NULL)
+        die("malloc");
+    size_t top = 0;
+    size_t i;
+    for (i = 0; i < n; i++)
+    {
+        rownode *t = &nodes[i];
+        t->prio = rowRandom();
+        t->right = NULL;
+        // 右链上优先级更低的节点成为 t 的左子树
+        rownode *last = NULL;
+        while (top > 0 && stack[top - 1]->prio < t->prio)
+            last = stack[--top];
+        t->left = last;
+        if (top > 0)
+            stack[top - 1]->right = t;
+        stack[top++] = t;
+    }
+    rownode *root = stack[0];
+    free(stack);
+    rowPullTree(root);
+    return root;
+}
+
+// 按行号查找行，越界时返回 NULL
+erow *editorRowAt(size_t at)
+{
+    rownode *t = E.rowroot;
+    if (at >= rowCount(t))
+        return NULL;
+    while (t)
+    {
+        size_t lc = rowCount(t->left);
+        if (at < lc)
+        {
+            t = t->left;
+        }
+        else if (at == lc)
+        {
+            break;
+        }
+        else
+        {
+            at -= lc + 1;
+            t = t->right;
+        }
+    }
+    return &t->row;
+}
+
+// 行所在的行号
+size_t editorRowIndex(erow *row)
+{
+    rownode *n = (rownode *)row;
+    size_t idx = rowCount(n->left);
+    while (n->parent)
+    {
+        if (n == n->parent->right)
+            idx += rowCount(n->parent->left) + 1;
+        n = n->parent;
+    }
+    return idx;
+}
+
+// 行在树中的深度，插入删除和按行号定位的代价与它成正比
+int editorRowDepth(erow *row)
+{
+    rownode *n = (rownode *)row;
+    int depth = 0;
+    while (n->parent)
+    {
+        n = n->parent;
+        depth++;
+    }
+    return depth;
+}
+
+// 下一行，作为遍历行的游标使用，连续遍历时均摊 O(1)
+erow *editorRowNext(erow *row)
+{
+    rownode *n = (rownode *)row;
+    if (n->right)
+    {
+        n = n->right;
+        while (n->left)
+            n = n->left;
+        return &n->row;
+    }
+    while (n->parent && n == n->parent->right)
+        n = n->parent;
+    return n->parent ? &n->parent->row : NULL;
+}
+
+erow *editorRowPrev(erow *row)
+{
+    rownode *n = (rownode *)row;
+    if (n->left)
+    {
+        n = n->left;
+        while (n->right)
+            n = n->right;
+        return &n->row;
+    }
+    while (n->parent && n == n->parent->left)
+        n = n->parent;
+    return n->parent ? &n->parent->row : NULL;
+}
+
+/*** syntax highlighting ***/
+
+int is_separator(int c)
+{
+    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
+
+// 把高亮区间复制到行中保存，申请不到内存时不保存并返回 -1
+int editorRowSetSpans(erow *row, const hlspan *spans, size_t n)
+{
+    editorArenaFree(row->hl, row->nhl * sizeof(hlspan));
+    row->hl = NULL;
+    row->nhl = 0;
+    if (n == 0)
+        return 0;
+    row->hl = editorArenaTryAlloc(n * sizeof(hlspan));
+    if (row->hl == NULL)
+        return -1;
+    memcpy(row->hl, spans, n * sizeof(hlspan));
+    row->nhl = n;
+    return 0;
+}
+
+// 64 位 FNV-1a，用于行索引缓存和 DFA 指纹，h 是之前的结果，第一次传 0
+uint64_t editorHash64(const void *p, size_t len, uint64_t h)
+{
+    const unsigned char *s = p;
+    size_t i;
+    if (h == 0)
+        h = 14695981039346656037ull;
+    for (i = 0; i < len; i++)
+    {
+        h ^= s[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// FNV-1a
+size_t editorKeywordHash(const char *s, size_t len)
+{
+    size_t h = 2166136261u;
+    size_t i;
+    for (i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// 把关键字列表编译成散列表，预先算好长度和高亮类型，末尾的 | 表示第二类关键字
+void editorCompileKeywords(struct editorSyntax *s)
+{
+    size_t n = 0;
+    while (s->keywords[n])
+        n++;
+    // 装载率不超过一半
+    size_t size = 1;
+    while (size < n * 2)
+        size <<= 1;
+    struct syntaxtable *kw = calloc(1, sizeof(struct syntaxtable));
+    if (kw == NULL)
+        die("calloc");
+    kw->slots = calloc(size, sizeof(struct keyword));
+    if (kw->slots == NULL)
+        die("calloc");
+    kw->mask = size - 1;
+    kw->maxlen = 0;
+    s->tab = kw;
+
+    size_t j;
+    for (j = 0; j < n; j++)
+    {
+        const char *word = s->keywords[j];
+        size_t len = strlen(word);
+        unsigned char type = HL_KEYWORD1;
+        if (len && word[len - 1] == '|')
+        {
+            len--;
+            type = HL_KEYWORD2;
+        }
+        if (len == 0 || len >= EDITOR_LEX_PENDING)
+            continue;
+        size_t h = editorKeywordHash(word, len) & kw->mask;
+        while (kw->slots[h].len)
+            h = (h + 1) & kw->mask;
+        kw->slots[h].word = word;
+        kw->slots[h].len = len;
+        kw->slots[h].type = type;
+        if (len > kw->maxlen)
+            kw->maxlen = len;
+    }
+}
+
+// 查找一个词，是关键字时返回它的高亮类型，否则返回 HL_NORMAL
+unsigned char editorKeywordLookup(struct syntaxtable *kw, const char *p, size_t len)
+{
+    if (len == 0 || len > kw->maxlen)
+        return HL_NORMAL;
+    size_t h = editorKeywordHash(p, len) & kw->mask;
+    while (kw->slots[h].len)
+    {
+        struct keyword *k = &kw->slots[h];
+        if (k->len == len && !memcmp(k->word, p, len))
+            return k->type;
+        h = (h + 1) & kw->mask;
+    }
+    return HL_NORMAL;
+}
+
+// 按语法定义填字符分类表
+void editorCompileClasses(struct editorSyntax *s)
+{
+    struct syntaxtable *t = s->tab;
+    int b;
+    for (b = 0; b < 256; b++)
+    {
+        unsigned char cls = 0;
+        // 与原来逐字节判断时一样按 char 传入
+        if (is_separator((char)b))
+            cls |= CLS_SEP;
+        if (isdigit(b))
+            cls |= CLS_DIGIT;
+        if ((s->flags & HL_HIGHLIGHT_STRINGS) && (b == '"' || b == '\''))
+            cls |= CLS_QUOTE;
+        t->cls[b] = cls;
+    }
+}
+
+// 编译 DFA 时的临时数据
+struct lexbuild
+{
+    struct editorSyntax *s;
+    struct keyword *prefixes; // 所有关键字的所有前缀，判断一个没写完的词还能不能成为关键字
+    size_t premask;
+    unsigned char *keys; // 每个状态 DFA_KEY_SIZE 字节：lexconf、待定字节数和待定字节
+    int cap;             // keys、trans、eol、skip 能容纳的状态数
+    int *ids;            // 状态的散列表，-1 为空位
+    size_t idmask;
+    int *outids; // outs 的散列表
+    size_t outmask;
+    int nouts, outcap;
+    size_t poolsize, poolcap;
+};
+
+int editorLexPrefix(struct lexbuild *b, const char *p, size_t len)
+{
+    size_t h = editorKeywordHash(p, len) & b->premask;
+    while (b->prefixes[h].len)
+    {
+        struct keyword *k = &b->prefixes[h];
+        if (k->len == len && !memcmp(k->word, p, len))
+            return 1;
+        h = (h + 1) & b->premask;
+    }
+    return 0;
+}
+
+// 待定字节中 i 处是否是 d：0 不是，1 是，-1 还要等更多字节
+int editorLexMatch(const char *p, size_t n, size_t i, const char *d, size_t dlen, int eol)
+{
+    size_t have = n - i < dlen ? n - i : dlen;
+    if (memcmp(&p[i], d, have))
+        return 0;
+    if (have == dlen)
+        return 1;
+    return eol ? 0 : -1;
+}
+
+// 按逐字节扫描的规则确定待定字节 p[0, n) 的高亮，eol 表示后面就是行尾
+// 需要看还没到达的字节才能决定时停下，返回已经确定的字节数，剩下的继续待定
+size_t editorLexDecide(struct lexbuild *b, struct lexconf *cf, const char *p, size_t n,
+                       int eol, unsigned char *hl)
+{
+    struct editorSyntax *s = b->s;
+    struct syntaxtable *t = s->tab;
+    char *scs = s->singleline_comment_start;
+    char *mcs = s->multiline_comment_start;
+    char *mce = s->multiline_comment_end;
+    size_t scs_len = scs ? strlen(scs) : 0;
+    size_t mcs_len = mcs ? strlen(mcs) : 0;
+    size_t mce_len = mce ? strlen(mce) : 0;
+
+    size_t i = 0;
+    while (i < n)
+    {
+        char c = p[i];
+        unsigned char cls = t->cls[(unsigned char)c];
+        int prev_num = i > 0 ? hl[i - 1] == HL_NUMBER : cf->prev_num;
+        int m;
+
+        // 单行注释到行尾
+        if (cf->line_comment)
+        {
+            hl[i++] = HL_COMMENT;
+            continue;
+        }
+        if (scs_len && !cf->in_string && !cf->in_comment)
+        {
+            if ((m = editorLexMatch(p, n, i, scs, scs_len, eol)) < 0)
+                break;
+            if (m)
+            {
+                cf->line_comment = 1;
+                continue;
+            }
+        }
+
+        if (mcs_len && mce_len && !cf->in_string)
+        {
+            if (cf->in_comment)
+            {
+                if ((m = editorLexMatch(p, n, i, mce, mce_len, eol)) < 0)
+                    break;
+                if (m)
+                {
+                    memset(&hl[i], HL_MLCOMMENT, mce_len);
+                    i += mce_len;
+                    cf->in_comment = 0;
+                    cf->prev_sep = 1;
+                    continue;
+                }
+                hl[i++] = HL_MLCOMMENT;
+                continue;
+            }
+            if ((m = editorLexMatch(p, n, i, mcs, mcs_len, eol)) < 0)
+                break;
+            if (m)
+            {
+                memset(&hl[i], HL_MLCOMMENT, mcs_len);
+                i += mcs_len;
+                cf->in_comment = 1;
+                continue;
+            }
+        }
+
+        if (s->flags & HL_HIGHLIGHT_STRINGS)
+        {
+            if (cf->in_string)
+            {
+                // 反斜杠跳过下一个字符，要知道它是不是行尾
+                if (c == '\\' && i + 1 == n && !eol)
+                    break;
+                hl[i] = HL_STRING;
+                if (c == '\\' && i + 1 < n)
+                {
+                    hl[i + 1] = HL_NORMAL;
+                    i += 2;
+                    continue;
+                }
+                if (c == cf->in_string)
+                    cf->in_string = 0;
+                i++;
+                cf->prev_sep = 1;
+                continue;
+            }
+            if (cls & CLS_QUOTE)
+            {
+                cf->in_string = c;
+                hl[i++] = HL_STRING;
+                continue;
+            }
+        }
+
+        if (s->flags & HL_HIGHLIGHT_NUMBERS)
+        {
+            if (((cls & CLS_DIGIT) && (cf->prev_sep || prev_num)) || (c == '.' && prev_num))
+            {
+                hl[i++] = HL_NUMBER;
+                cf->prev_sep = 0;
+                continue;
+            }
+        }
+
+        // 关键词要一直看到分隔符或行尾；词还没结束且可能是关键字的前缀时等待
+        if (cf->prev_sep)
+        {
+            size_t klen = 0;
+            while (i + klen < n && klen <= t->maxlen &&
+                   !(t->cls[(unsigned char)p[i + klen]] & CLS_SEP))
+                klen++;
+            unsigned char type = HL_NORMAL;
+            if (i + klen < n || klen > t->maxlen || eol)
+                type = editorKeywordLookup(t, &p[i], klen);
+            else if (editorLexPrefix(b, &p[i], klen))
+                break;
+            if (type != HL_NORMAL)
+            {
+                memset(&hl[i], type, klen);
+                i += klen;
+                cf->prev_sep = 0;
+                continue;
+            }
+        }
+
+        hl[i++] = HL_NORMAL;
+        cf->prev_sep = (cls & CLS_SEP) != 0;
+    }
+    if (i > 0)
+        cf->prev_num = hl[i - 1] == HL_NUMBER;
+    return i;
+}
+
+// 查找或加入一个状态，返回编号，状态过多时返回 -1
+int editorLexState(struct lexbuild *b, struct lexconf *cf, const char *p, size_t n)
+{
+    struct syntaxtable *t = b->s->tab;
+    unsigned char key[DFA_KEY_SIZE];
+    memset(key, 0, sizeof(key));
+    // 注释和字符串中用不到的字段统一成相同的值，减少状态数
+    if (cf->line_comment)
+    {
+        key[2] = 1;
+    }
+    else
+    {
+        key[0] = cf->in_string;
+        key[1] = cf->in_comment;
+        key[3] = cf->in_string || cf->in_comment ? 1 : cf->prev_sep;
+        key[4] = cf->in_string || cf->in_comment ? 0 : cf->prev_num;
+    }
+    key[5] = n;
+    memcpy(&key[6], p, n);
+
+    size_t h = editorKeywordHash((char *)key, 6 + n) & b->idmask;
+    while (b->ids[h] != -1)
+    {
+        if (!memcmp(&b->keys[(size_t)b->ids[h] * DFA_KEY_SIZE], key, DFA_KEY_SIZE))
+            return b->ids[h];
+        h = (h + 1) & b->idmask;
+    }
+    if (t->nstates >= DFA_MAX_STATES)
+        return -1;
+
+    int id = t->nstates++;
+    if (id == b->cap)
+    {
+        b->cap = b->cap ? b->cap * 2 : 64;
+        b->keys = realloc(b->keys, (size_t)b->cap * DFA_KEY_SIZE);
+        t->trans = realloc(t->trans, (size_t)b->cap * 256 * sizeof(struct dfatrans));
+        t->eol = realloc(t->eol, (size_t)b->cap * sizeof(struct dfatrans));
+        t->skip = realloc(t->skip, (size_t)b->cap * sizeof(struct dfaskip));
+        if (b->keys == NULL || t->trans == NULL || t->eol == NULL || t->skip == NULL)
+            die("realloc");
+    }
+    memcpy(&b->keys[(size_t)id * DFA_KEY_SIZE], key, DFA_KEY_SIZE);
+    b->ids[h] = id;
+    return id;
+}
+
+// 返回一次确定 n 个字节时转移的 out，多个字节的高亮相同的只保存一份，太多时返回 -1
+int editorLexOutput(struct lexbuild *b, const unsigned char *hl, size_t n)
+{
+    struct syntaxtable *t = b->s->tab;
+    if (n == 0)
+        return DFA_OUT_HOLD;
+    if (n == 1)
+        return hl[0];
+
+    size_t h = editorKeywordHash((const char *)hl, n) & b->outmask;
+    while (b->outids[h] != -1)
+    {
+        struct dfaout *o = &t->outs[b->outids[h]];
+        if (o->len == n && !memcmp(&t->outpool[o->off], hl, n))
+            return DFA_OUT_HOLD + 1 + b->outids[h];
+        h = (h + 1) & b->outmask;
+    }
+    if (b->nouts >= DFA_MAX_STATES - DFA_OUT_HOLD - 1)
+        return -1;
+
+    if (b->nouts == b->outcap)
+    {
+        b->outcap = b->outcap ? b->outcap * 2 : 64;
+        t->outs = realloc(t->outs, (size_t)b->outcap * sizeof(struct dfaout));
+        if (t->outs == NULL)
+            die("realloc");
+    }
+    if (b->poolsize + n > b->poolcap)
+    {
+        b->poolcap = b->poolcap ? b->poolcap * 2 : 1024;
+        t->outpool = realloc(t->outpool, b->poolcap);
+        if (t->outpool == NULL)
+            die("realloc");
+    }
+    int id = b->nouts++;
+    t->outs[id].off = b->poolsize;
+    t->outs[id].len = n;
+    memcpy(&t->outpool[b->poolsize], hl, n);
+    b->poolsize += n;
+    b->outids[h] = id;
+    return DFA_OUT_HOLD + 1 + id;
+}
+
+// 找出可以整段跳过的状态
+void editorLexSkips(struct syntaxtable *t)
+{
+    int st, c;
+    for (st = 0; st < t->nstates; st++)
+    {
+        struct dfatrans *tr = &t->trans[(size_t)st * 256];
+        struct dfaskip *k = &t->skip[st];
+        k->kind = DFA_SKIP_NONE;
+        k->type = tr['a'].out;
+        if (tr['a'].next != st || tr['a'].out >= DFA_OUT_HOLD)
+            continue;
+
+        int other = 0, word = 1;
+        for (c = 0; c < 256; c++)
+        {
+            if (tr[c].next == st && tr[c].out == k->type)
+                continue;
+            other++;
+            k->stop = c;
+            if (isalnum(c) || c == '_' || c >= 0x80)
+                word = 0;
+        }
+        if (other == 0)
+            k->kind = DFA_SKIP_ALL;
+        else if (other == 1)
+            k->kind = DFA_SKIP_CHR;
+#ifdef __SSE2__
+        else if (word)
+            k->kind = DFA_SKIP_WORD;
+#endif
+    }
+}
+
+// 把语法定义编译成 DFA：模拟逐字节的扫描器，它要看后面的字节才能决定时把字节留作待定，
+// 扫描器的状态加上待定的字节就是 DFA 的状态。对所有能到达的状态和 256 个字节各算一次转移，
+// 高亮时每个字节只查一次表，不回溯。状态过多时返回 -1
+int editorCompileLexer(struct editorSyntax *s)
+{
+    struct syntaxtable *t = s->tab;
+    struct lexbuild b;
+    memset(&b, 0, sizeof(b));
+    b.s = s;
+
+    // 关键字的所有前缀
+    size_t nprefix = 0, j, l;
+    for (j = 0; j <= t->mask; j++)
+        nprefix += t->slots[j].len;
+    size_t size = 1;
+    while (size < nprefix * 2)
+        size <<= 1;
+    b.prefixes = calloc(size, sizeof(struct keyword));
+    if (b.prefixes == NULL)
+        die("calloc");
+    b.premask = size - 1;
+    for (j = 0; j <= t->mask; j++)
+    {
+        for (l = 1; l <= t->slots[j].len; l++)
+        {
+            const char *w = t->slots[j].word;
+            if (editorLexPrefix(&b, w, l))
+                continue;
+            size_t h = editorKeywordHash(w, l) & b.premask;
+            while (b.prefixes[h].len)
+                h = (h + 1) & b.premask;
+            b.prefixes[h].word = w;
+            b.prefixes[h].len = l;
+        }
+    }
+
+    // 散列表大小是状态数上限的两倍
+    size_t idsize = 1;
+    while (idsize < 2 * (size_t)DFA_MAX_STATES)
+        idsize <<= 1;
+    b.ids = malloc(idsize * sizeof(int));
+    b.outids = malloc(idsize * sizeof(int));
+    if (b.ids == NULL || b.outids == NULL)
+        die("malloc");
+    memset(b.ids, -1, idsize * sizeof(int));
+    memset(b.outids, -1, idsize * sizeof(int));
+    b.idmask = b.outmask = idsize - 1;
+
+    t->nstates = 0;
+    struct lexconf start = {0, 0, 0, 1, 0};
+    editorLexState(&b, &start, NULL, 0);
+
+    int ret = 0, st, c;
+    for (st = 0; st < t->nstates && ret == 0; st++)
+    {
+        // keys 可能在加入状态时重新分配，先复制出来
+        unsigned char key[DFA_KEY_SIZE];
+        memcpy(key, &b.keys[(size_t)st * DFA_KEY_SIZE], DFA_KEY_SIZE);
+        size_t n = key[5];
+        char buf[EDITOR_LEX_PENDING + 1];
+        unsigned char hl[EDITOR_LEX_PENDING + 1];
+        memcpy(buf, &key[6], n);
+
+        // 0 到 255 是下一个字节，256 是行尾
+        for (c = 0; c <= 256; c++)
+        {
+            struct lexconf cf = {key[0], key[1], key[2], key[3], key[4]};
+            size_t len = n;
+            if (c < 256)
+                buf[len++] = (char)c;
+            size_t done = editorLexDecide(&b, &cf, buf, len, c == 256, hl);
+            int next, out = editorLexOutput(&b, hl, done);
+            if (c == 256)
+            {
+                // 只有多行注释会延续到下一行
+                struct lexconf line = {0, cf.in_comment, 0, 1, 0};
+                next = editorLexState(&b, &line, NULL, 0);
+            }
+            else
+            {
+                next = editorLexState(&b, &cf, &buf[done], len - done);
+            }
+            if (next < 0 || out < 0)
+            {
+                ret = -1;
+                break;
+            }
+            struct dfatrans *e = c == 256 ? &t->eol[st] : &t->trans[(size_t)st * 256 + c];
+            e->next = next;
+            e->out = out;
+        }
+    }
+
+    if (ret == 0)
+    {
+        editorLexSkips(t);
+        t->fingerprint = editorHash64(&t->nstates, sizeof(t->nstates), 0);
+        t->fingerprint = editorHash64(t->trans, (size_t)t->nstates * 256 * sizeof(struct dfatrans),
+                                      t->fingerprint);
+        t->fingerprint = editorHash64(t->eol, (size_t)t->nstates * sizeof(struct dfatrans),
+                                      t->fingerprint);
+    }
+    free(b.prefixes);
+    free(b.keys);
+    free(b.ids);
+    free(b.outids);
+    return ret;
+}
+
+#ifdef __SSE2__
+// 跳过从 i 开始的 [A-Za-z0-9_] 和非 ASCII 字节，返回第一个不是的位置
+// 减去区间起点后用饱和减法判断是否超过区间长度，非 ASCII 字节直接看符号位
+size_t editorSkipWord(const char *text, size_t i, size_t len)
+{
+    const __m128i upper = _mm_set1_epi8('A'), lower = _mm_set1_epi8('a');
+    const __m128i digit = _mm_set1_epi8('0'), under = _mm_set1_epi8('_');
+    const __m128i span25 = _mm_set1_epi8(25), span9 = _mm_set1_epi8(9);
+    const __m128i zero = _mm_setzero_si128();
+    while (i + 16 <= len)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(text + i));
+        __m128i up = _mm_cmpeq_epi8(_mm_subs_epu8(_mm_sub_epi8(v, upper), span25), zero);
+        __m128i lo = _mm_cmpeq_epi8(_mm_subs_epu8(_mm_sub_epi8(v, lower), span25), zero);
+        __m128i dg = _mm_cmpeq_epi8(_mm_subs_epu8(_mm_sub_epi8(v, digit), span9), zero);
+        __m128i word = _mm_or_si128(_mm_or_si128(up, lo), _mm_or_si128(dg, _mm_cmpeq_epi8(v, under)));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(word) | (unsigned int)_mm_movemask_epi8(v);
+        if (mask != 0xffff)
+            return i + __builtin_ctz(~mask);
+        i += 16;
+    }
+    while (i < len && (isalnum((unsigned char)text[i]) || text[i] == '_' || (unsigned char)text[i] >= 0x80))
+        i++;
+    return i;
+}
+#endif
+
+void editorHlReset(struct hlsink *out)
+{
+    out->n = 0;
+    out->pos = 0;
+    out->type = HL_NORMAL;
+    out->len = 0;
+    out->err = 0;
+}
+
+// 把还没写入的一段保存成区间
+void editorHlFlush(struct hlsink *out)
+{
+    size_t at = out->pos, len = out->len;
+    out->pos += len;
+    out->len = 0;
+    if (out->type == HL_NORMAL || len == 0 || out->err || at >= UINT_MAX)
+        return;
+    if (len > UINT_MAX - at)
+        len = UINT_MAX - at;
+    if (out->n == out->cap)
+    {
+        size_t cap = out->cap ? out->cap * 2 : 64;
+        hlspan *spans = realloc(out->spans, cap * sizeof(hlspan));
+        if (spans == NULL)
+        {
+            out->err = 1;
+            return;
+        }
+        out->spans = spans;
+        out->cap = cap;
+    }
+    out->spans[out->n].start = at;
+    out->spans[out->n].len = len;
+    out->spans[out->n].type = out->type;
+    out->n++;
+}
+
+// 接下来的 len 个字节高亮为 type，类型不变时只累加长度
+void editorHlEmit(struct hlsink *out, unsigned char type, size_t len)
+{
+    if (type != out->type)
+    {
+        editorHlFlush(out);
+        out->type = type;
+    }
+    out->len += len;
+}
+
+// 写出 DFA 的一个输出
+void editorHlEmitOut(struct hlsink *out, const struct syntaxtable *t, int o)
+{
+    if (o < DFA_OUT_HOLD)
+    {
+        editorHlEmit(out, o, 1);
+    }
+    else if (o > DFA_OUT_HOLD)
+    {
+        const struct dfaout *d = &t->outs[o - DFA_OUT_HOLD - 1];
+        size_t k;
+        for (k = 0; k < d->len; k++)
+            editorHlEmit(out, t->outpool[d->off + k], 1);
+    }
+}
+
+// 用 DFA 高亮 text，state 是进入时的状态，返回处理完后的状态，行尾由 editorHighlightEnd() 处理
+// 一行可以分几段依次传入，不需要连续；out 为 NULL 时只计算状态
+int editorHighlightRun(const char *text, size_t len, int state, struct hlsink *out)
+{
+    const struct syntaxtable *t = E.syntax->tab;
+    // 切换文件类型后，行中保存的状态属于之前的 DFA
+    if (state < 0 || state >= t->nstates)
+        state = 0;
+
+    size_t i = 0;
+    while (i < len)
+    {
+        const struct dfaskip *k = &t->skip[state];
+        if (k->kind != DFA_SKIP_NONE)
+        {
+            size_t j = len;
+            if (k->kind == DFA_SKIP_CHR)
+            {
+                const char *stop = memchr(&text[i], k->stop, len - i);
+                j = stop ? (size_t)(stop - text) : len;
+            }
+#ifdef __SSE2__
+            else if (k->kind == DFA_SKIP_WORD)
+                j = editorSkipWord(text, i, len);
+#endif
+            if (out)
+                editorHlEmit(out, k->type, j - i);
+            i = j;
+            if (i == len)
+                break;
+        }
+
+        const struct dfatrans *e = &t->trans[((size_t)state << 8) | (unsigned char)text[i++]];
+        state = e->next;
+        if (out && e->out != DFA_OUT_HOLD)
+            editorHlEmitOut(out, t, e->out);
+    }
+    return state;
+}
+
+// 行尾确定剩下的字节，返回下一行开始时的状态
+int editorHighlightEnd(int state, struct hlsink *out)
+{
+    const struct syntaxtable *t = E.syntax->tab;
+    if (state < 0 || state >= t->nstates)
+        state = 0;
+    const struct dfatrans *e = &t->eol[state];
+    if (out)
+    {
+        if (e->out != DFA_OUT_HOLD)
+            editorHlEmitOut(out, t, e->out);
+        editorHlFlush(out);
+    }
+    return e->next;
+}
+
+// 高亮连续的一行文本，返回离开这一行时的状态
+int editorHighlight(const char *text, size_t len, int state, struct hlsink *out)
+{
+    return editorHighlightEnd(editorHighlightRun(text, len, state, out), out);
+}
+
+// 高亮 row 的内容，间隙两边分两段处理，不复制整行，工作线程中也可以调用
+int editorHighlightRow(erow *row, int state, struct hlsink *out)
+{
+    state = editorHighlightRun(row->chars, row->gap, state, out);
+    state = editorHighlightRun(&row->chars[row->gap + row->gaplen], row->size - row->gap, state, out);
+    return editorHighlightEnd(state, out);
+}
+
+// 记录第 at 行结束时的高亮状态，并维护 hlvalid
+// 各行的结束状态就是检查点：只要进入某行的状态可靠，从这一行开始就能重新高亮
+// 状态改变时只把 hlvalid 退回到这一行之后，后面的行在显示前再重新计算，不递归
+void editorSyntaxSetState(erow *row, size_t at, int state)
+{
+    if (at == E.hlvalid || (at < E.hlvalid && row->hl_state != state))
+        E.hlvalid = at + 1;
+    row->hl_state = state;
+}
+
+void editorUpdateSyntax(erow *row)
+{
+    // 没有文件类型时整行都是普通文本，不需要逐字节的缓冲区
+    if (E.syntax == NULL)
+    {
+        editorArenaFree(row->hl, row->nhl * sizeof(hlspan));
+        row->hl = NULL;
+        row->nhl = 0;
+        return;
+    }
+
+    // 主线程中所有行共用一个临时的区间缓冲区
+    static struct hlsink sink;
+    double start = editorNow();
+    erow *prev = editorRowPrev(row);
+    editorHlReset(&sink);
+    int state = editorHighlight(row->render, row->rsize, prev ? prev->hl_state : 0, &sink);
+    if (editorRowSetSpans(row, sink.spans, sink.n) != 0)
+        sink.err = 1;
+    // 很长的行用完就释放，缓冲区不一直保持最大的大小
+    if (sink.cap > EDITOR_HL_SPANS_KEEP)
+    {
+        free(sink.spans);
+        sink.spans = NULL;
+        sink.cap = 0;
+    }
+    E.hlbytes += row->rsize;
+    E.hltime += editorNow() - start;
+    size_t at = editorRowIndex(row);
+    if (sink.err)
+        editorSetStatusMessage("Out of memory: line %zu is not fully highlighted", at + 1);
+    editorSyntaxSetState(row, at, state);
+}
+
+// 从 row 开始计算 n 行结束时的状态，state 是进入第一行时的状态，返回最后一行结束时的状态
+// converge 不为 -1 时，某行算出的状态和已保存的相同就停止并返回 converge：
+// 之后各行的输入相同，已保存的结果不会再变
+int editorSyntaxScan(erow *row, size_t n, int state, int converge, size_t *bytes)
+{
+    size_t i;
+    for (i = 0; i < n; i++, row = editorRowNext(row))
+    {
+        state = editorHighlightRow(row, state, NULL);
+        *bytes += row->size;
+        if (converge != -1 && row->hl_state == state)
+            return converge;
+        row->hl_state = state;
+    }
+    return state;
+}
+
+void *editorSyntaxWorker(void *arg)
+{
+    struct hljob *job = arg;
+    while (1)
+    {
+        pthread_mutex_lock(&job->lock);
+        size_t i = job->next++;
+        pthread_mutex_unlock(&job->lock);
+        if (i >= job->nchunks)
+            break;
+        struct hlchunk *c = &job->chunks[i];
+        c->exit = editorSyntaxScan(c->first, c->n, c->entry, -1, &c->bytes);
+    }
+    return NULL;
+}
+
+// 并行计算 [hlvalid, upto) 各行结束时的状态
+// 每段推测从普通的行首状态 0 开始，各段同时计算；之后按顺序修正：
+// 某段实际的进入状态和推测不同时重新计算这一段，直到和推测的结果汇合
+// 计算期间主线程等待，行树不会改变
+void editorSyntaxValidateParallel(size_t upto)
+{
+    double start = editorNow();
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = ncpu < 1 ? 1 : ncpu > EDITOR_HL_THREADS ? EDITOR_HL_THREADS : ncpu;
+    pthread_t threads[EDITOR_HL_THREADS];
+
+    size_t from = E.hlvalid;
+    size_t total = upto - from;
+    size_t per = total / (nthreads * 8) + 1;
+    struct hljob job;
+    job.nchunks = (total + per - 1) / per;
+    job.chunks = malloc(sizeof(struct hlchunk) * job.nchunks);
+    if (job.chunks == NULL)
+        die("malloc");
+    job.next = 0;
+    pthread_mutex_init(&job.lock, NULL);
+
+    erow *first = editorRowAt(from);
+    erow *prev = editorRowPrev(first);
+    int entry = prev ? prev->hl_state : 0;
+    size_t k;
+    for (k = 0; k < job.nchunks; k++)
+    {
+        struct hlchunk *c = &job.chunks[k];
+        c->first = k == 0 ? first : editorRowAt(from + k * per);
+        c->n = k + 1 < job.nchunks ? per : total - k * per;
+        // 第一段的进入状态是确定的
+        c->entry = k == 0 ? entry : 0;
+        c->bytes = 0;
+    }
+
+    int started = 0;
+    while (started < nthreads &&
+           pthread_create(&threads[started], NULL, editorSyntaxWorker, &job) == 0)
+        started++;
+    if (started == 0)
+        editorSyntaxWorker(&job);
+    while (started > 0)
+        pthread_join(threads[--started], NULL);
+    pthread_mutex_destroy(&job.lock);
+
+    // 按顺序修正推测错误的段
+    size_t bytes = 0;
+    int state = entry;
+    for (k = 0; k < job.nchunks; k++)
+    {
+        struct hlchunk *c = &job.chunks[k];
+        bytes += c->bytes;
+        if (c->entry != state)
+            c->exit = editorSyntaxScan(c->first, c->n, state, c->exit, &bytes);
+        state = c->exit;
+    }
+    free(job.chunks);
+    E.hlvalid = upto;
+    E.hlbytes += bytes;
+    E.hltime += editorNow() - start;
+
+    // 已加载的行按可靠的状态重新高亮
+    size_t lo = E.reslo > from ? E.reslo : from;
+    size_t hi = E.reshi < upto ? E.reshi : upto;
+    erow *row = lo < hi ? editorRowAt(lo) : NULL;
+    for (; lo < hi; lo++, row = editorRowNext(row))
+    {
+        if (row->render)
+            editorUpdateSyntax(row);
+    }
+}
+
+// 确保前 upto 行结束时的状态可靠：从 hlvalid 开始顺序计算，行数较多时并行计算
+// 已加载的行重新高亮，未加载的行只计算状态，不保存高亮
+void editorSyntaxValidate(size_t upto)
+{
+    if (E.syntax == NULL)
+        return;
+    if (upto > E.numrows)
+        upto = E.numrows;
+    if (E.hlvalid >= upto)
+        return;
+    if (upto - E.hlvalid >= EDITOR_HL_PARALLEL_ROWS)
+    {
+        editorSyntaxValidateParallel(upto);
+        return;
+    }
+
+    erow *row = editorRowAt(E.hlvalid);
+    erow *prev = editorRowPrev(row);
+    while (E.hlvalid < upto)
+    {
+        if (row->render)
+        {
+            editorUpdateSyntax(row);
+        }
+        else
+        {
+            double start = editorNow();
+            int state = editorHighlightRow(row, prev ? prev->hl_state : 0, NULL);
+            E.hlbytes += row->size;
+            E.hltime += editorNow() - start;
+            editorSyntaxSetState(row, E.hlvalid, state);
+        }
+        prev = row;
+        row = editorRowNext(row);
+    }
+}
+
+int editorSyntaxToColor(int hl)
+{
+    switch (hl)
+    {
+    case HL_COMMENT:
+    case HL_MLCOMMENT:
+        return 36; // 青色
+    case HL_KEYWORD1:
+        return 33; // 黄色
+    case HL_KEYWORD2:
+        return 32; // 绿色
+    case HL_STRING:
+        return 35; // 洋红色
+    case HL_NUMBER:
+        return 31; // 红色
+    case HL_MATCH:
+        return 7; // 反色
+    case HL_MATCHALL:
+        return 44; // 蓝色背景
+    default:
+        return 37;
+    }
+}
+
+// 按文件名在高亮数据库中查找文件类型
+struct editorSyntax *editorMatchSyntax()
+{
+    if (E.filename == NULL)
+        return NULL;
+
+    char *ext = strrchr(E.filename, '.'); // 返回指向字符串中最后一个字符出现的指针
+
+    for (size_t j = 0; j < E.nsyntax; j++)
+    {
+        struct editorSyntax *s = &E.syntaxdb[j];
+        unsigned int i = 0;
+        while (s->filematch[i])
+        {
+            int is_ext = (s->filematch[i][0] == '.'); // 是否有拓展名
+            // 检查文件类型是否与高亮数据库中的匹配，有拓展名比较拓展名，无拓展名比较文件名
+            if ((is_ext && ext && !strcmp(ext, s->filematch[i])) || (!is_ext && strstr(E.filename, s->filematch[i])))
+                return s;
+            i++;
+        }
+    }
+    return NULL;
+}
+
+void editorSelectSyntaxHighlight()
+{
+    struct editorSyntax *old = E.syntax;
+    E.syntax = editorMatchSyntax();
+    if (E.syntax == old)
+        return;
+    // 高亮 DFA 在第一次使用这个文件类型时编译
+    if (E.syntax && E.syntax->tab->trans == NULL && editorCompileLexer(E.syntax) != 0)
+    {
+        editorSetStatusMessage("%s: too many highlight states", E.syntax->filetype);
+        E.syntax = NULL;
+        if (old == NULL)
+            return;
+    }
+
+    // 确保文件类型更改时 (open, save) 突出显示立即更改
+    // 所有行的状态都不再可靠，只立即重新高亮已加载的行，其它行在显示前计算
+    E.hlvalid = 0;
+    size_t j;
+    erow *row = editorRowAt(E.reslo);
+    for (j = E.reslo; j < E.reshi && row; j++, row = editorRowNext(row))
+    {
+        if (row->render)
+            editorUpdateSyntax(row);
+    }
+}
+
+/*** row operations ***/
+
+// 读取第 at 个字符，跳过间隙
+char editorRowChar(erow *row, size_t at)
+{
+    return at < row->gap ? row->chars[at] : row->chars[at + row->gaplen];
+}
+
+// chars 即将被移动或释放，和它共用内存的 render 随之失效
+// hl 保留到下一次 editorUpdateRow() 或 editorRowUnload() 时释放
+void editorRowDropShared(erow *row)
+{
+    if (row->render == row->chars)
+        row->render = NULL;
+}
+
+// 把间隙移动到 at，只搬动两者之间的字符
+void editorRowMoveGap(erow *row, size_t at)
+{
+    if (at < row->gap)
+        memmove(&row->chars[at + row->gaplen], &row->chars[at], row->gap - at);
+    else if (at > row->gap)
+        memmove(&row->chars[row->gap], &row->chars[row->gap + row->gaplen], at - row->gap);
+    row->gap = at;
+}
+
+// 确保间隙至少有 len 字节，扩容时按行长成比例增长
+void editorRowReserve(erow *row, size_t len)
+{
+    if (row->gaplen >= len)
+        return;
+    size_t gaplen = len + row->size / 2;
+    if (gaplen < EDITOR_GAP_MIN)
+        gaplen = EDITOR_GAP_MIN;
+    gaplen = editorArenaSize(row->size + gaplen) - row->size;
+    editorRowDropShared(row);
+    row->chars = editorArenaRealloc(row->chars, row->size + row->gaplen, row->size + gaplen);
+    // 间隙之后的内容移到新的末尾
+    memmove(&row->chars[row->gap + gaplen], &row->chars[row->gap + row->gaplen],
+            row->size - row->gap);
+    row->gaplen = gaplen;
+}
+
+// 把间隙移到行尾，返回连续的行内容
+char *editorRowLinear(erow *row)
+{
+    editorRowMoveGap(row, row->size);
+    return row->chars;
+}
+
+size_t editorRowCxToRx(erow *row, size_t cx)
+{
+    size_t rx = 0;
+    size_t j;
+    for (j = 0; j < cx; j++)
+    {
+        if (editorRowChar(row, j) == '\t')
+            // 到达下一个制表位
+            rx += (EDITOR_TAB_STOP - 1) - (rx % EDITOR_TAB_STOP);
+        rx++;
+    }
+    return rx;
+}
+
+// 扩大持有 render/hl 的行范围，使其包含第 at 行
+void editorResidentMark(size_t at)
+{
+    if (E.reslo >= E.reshi)
+    {
+        E.reslo = at;
+        E.reshi = at + 1;
+        return;
+    }
+    if (at < E.reslo)
+        E.reslo = at;
+    if (at >= E.reshi)
+        E.reshi = at + 1;
+}
+
+// 释放 render 自己的副本，和 chars 共用时只断开引用
+void editorRowFreeRender(erow *row)
+{
+    if (row->render != row->chars)
+        editorArenaFree(row->render, row->rsize);
+    row->render = NULL;
+}
+
+void editorUpdateRow(erow *row)
+{
+    editorRowFreeRender(row);
+
+    // render 是行内容的连续视图，tab 在绘制时才展开到制表位
+    // 映射中的行和间隙在行尾的行直接使用 chars，只有间隙在行中间时才复制一份
+    if (row->gap == row->size)
+    {
+        row->render = row->chars;
+    }
+    else
+    {
+        row->render = editorArenaAlloc(row->size);
+        memcpy(row->render, row->chars, row->gap);
+        memcpy(&row->render[row->gap], &row->chars[row->gap + row->gaplen], row->size - row->gap);
+    }
+    row->rsize = row->size;
+
+    size_t at = editorRowIndex(row);
+    editorResidentMark(at);
+    editorMatchForget(row, at);
+    editorUpdateSyntax(row);
+}
+
+// 确保行的 render 和 hl 已生成
+void editorRowLoad(erow *row)
+{
+    if (row->render == NULL)
+        editorUpdateRow(row);
+}
+
+// 释放 render 和 hl，需要时再由 editorRowLoad() 重新生成
+void editorRowUnload(erow *row)
+{
+    editorRowFreeRender(row);
+    editorArenaFree(row->hl, row->nhl * sizeof(hlspan));
+    row->hl = NULL;
+    row->nhl = 0;
+    row->rsize = 0;
+}
+
+// mapped 行在修改之前复制出可写的 chars
+void editorRowOwn(erow *row)
+{
+    if (!row->mapped)
+        return;
+    size_t cap = editorArenaSize(row->size + EDITOR_GAP_MIN);
+    char *chars = editorArenaAlloc(cap);
+    memcpy(chars, row->chars, row->size);
+    editorRowDropShared(row);
+    row->chars = chars;
+    row->gap = row->size;
+    row->gaplen = cap - row->size;
+    row->mapped = 0;
+    rowPullUp(row);
+}
+
+// 释放离视口较远的行的 render/hl，只遍历 [reslo, reshi) 中落在保留窗口外的部分
+void editorEvictRows()
+{
+    size_t lo = E.rowoff > EDITOR_RESIDENT_MARGIN ? E.rowoff - EDITOR_RESIDENT_MARGIN : 0;
+    size_t hi = E.rowoff + E.screenrows + EDITOR_RESIDENT_MARGIN;
+    if (hi > E.numrows)
+        hi = E.numrows;
+    if (E.reshi > E.numrows)
+        E.reshi = E.numrows;
+
+    size_t j;
+    erow *row = editorRowAt(E.reslo);
+    for (j = E.reslo; j < E.reshi && j < lo; j++, row = editorRowNext(row))
+        editorRowUnload(row);
+    j = (hi > E.reslo ? hi : E.reslo);
+    for (row = editorRowAt(j); j < E.reshi; j++, row = editorRowNext(row))
+        editorRowUnload(row);
+
+    if (E.reslo < lo)
+        E.reslo = lo;
+    if (E.reshi > hi)
+        E.reshi = hi;
+    if (E.reslo >= E.reshi)
+        E.reslo = E.reshi = 0;
+}
+
+void editorInsertRow(size_t at, char *s, size_t len)
+{
+    if (at > E.numrows)
+        return;
+
+    rownode *n = editorArenaNode();
+    erow *row = &n->row;
+
+    row->size = len;
+    size_t cap = editorArenaSize(len + 1);
+    row->chars = editorArenaAlloc(cap);
+    // 将给定字符串复制到新行，分级多出的空间都留作间隙
+    memcpy(row->chars, s, len);
+    row->gap = len;
+    row->gaplen = cap - len;
+
+    row->rsize = 0;
+    row->render = NULL;
+    row->hl = NULL;
+    row->nhl = 0;
+    row->hl_state = 0;
+    row->mapped = 0;
+
+    double start = editorNow();
+    rowTreeInsert(at, n);
+    E.rowtime += editorNow() - start;
+    E.rowops++;
+    E.numrows++; // 表示行数 +1
+    if (at < E.reshi)
+        E.reshi++;
+    if (at < E.reslo)
+        E.reslo++;
+    // 新行先沿用上一行结束时的状态，高亮后状态不同时后面的行才需要重新计算
+    erow *prev = editorRowPrev(row);
+    row->hl_state = prev ? prev->hl_state : 0;
+    if (at < E.hlvalid)
+        E.hlvalid++;
+    editorUpdateRow(row);
+
+    E.dirty++; // 脏位
+}
+
+void editorFreeRow(erow *row)
+{
+    editorRowFreeRender(row);
+    if (!row->mapped)
+        editorArenaFree(row->chars, row->size + row->gaplen);
+    editorArenaFree(row->hl, row->nhl * sizeof(hlspan));
+}
+
+void editorDelRow(size_t at)
+{
+    // 检查位置合法性
+    if (at >= E.numrows)
+        return;
+    double start = editorNow();
+    rownode *n = rowTreeRemove(at);
+    E.rowtime += editorNow() - start;
+    E.rowops++;
+    // 下一行进入时的状态变成上一行结束时的状态，不同时从这里开始重新计算
+    if (at < E.hlvalid)
+    {
+        erow *prev = at > 0 ? editorRowAt(at - 1) : NULL;
+        E.hlvalid--;
+        if (n->row.hl_state != (prev ? prev->hl_state : 0) && at < E.hlvalid)
+            E.hlvalid = at;
+    }
+    if (&n->row == E.match_row)
+        E.match_row = NULL;
+    editorMatchForget(&n->row, at);
+    editorFreeRow(&n->row);
+    editorArenaFreeNode(n);
+    if (at < E.reshi)
+        E.reshi--;
+    if (at < E.reslo)
+        E.reslo--;
+    E.numrows--;
+    E.dirty++;
+}
+
+// 关闭文档：行节点和行内容都在行存储中，整体释放即可，不逐行遍历
+void editorFreeRows()
+{
+    editorArenaRelease();
+    E.rowroot = NULL;
+    E.numrows = 0;
+    E.reslo = E.reshi = 0;
+}
+
+void editorRowInsertChar(erow *row, size_t at, int c)
+{
+    // 检查字符位置是否合规
+    if (at > row->size)
+        at = row->size;
+    editorRowOwn(row);
+    editorRowReserve(row, 1);
+    editorRowMoveGap(row, at);
+    row->chars[row->gap++] = c;
+    row->gaplen--;
+    row->size++;
+    editorUpdateRow(row);
+
+    E.dirty++;
+}
+
+void editorRowAppendString(erow *row, char *s, size_t len)
+{
+    editorRowOwn(row);
+    editorRowReserve(row, len);
+    editorRowMoveGap(row, row->size);
+    memcpy(&row->chars[row->gap], s, len);
+    row->gap += len;
+    row->gaplen -= len;
+    row->size += len;
+    editorUpdateRow(row);
+    E.dirty++;
+}
+
+void editorRowDelChar(erow *row, size_t at)
+{
+    // 检查字符位置是否合规
+    if (at >= row->size)
+        return;
+    editorRowOwn(row);
+    // 删除字符：间隙移到该字符前，再把它并入间隙
+    editorRowMoveGap(row, at);
+    row->gaplen++;
+    row->size--;
+    editorUpdateRow(row);
+    E.dirty++;
+}
+
+/*** editor operations ***/
+
+void editorInsertChar(int c)
+{
+    // 后台加载中光标所在行可能还没有接入
+    editorLoadUntil(E.cy + 1);
+    // 如果光标位于文件末尾的波浪线上，需要插入字符前添加一个新行
+    if (E.cy == E.numrows)
+    {
+        editorInsertRow(E.numrows, "", 0);
+    }
+    editorRowInsertChar(editorRowAt(E.cy), E.cx, c);
+    E.cx++;
+}
+
+void editorInsertNewline()
+{
+    editorLoadUntil(E.cy + 1);
+    // 如果在第一行开头，在所在行之前插入空白行
+    if (E.cx == 0)
+    {
+        editorInsertRow(E.cy, "", 0);
+    }
+    else
+    {
+        erow *row = editorRowAt(E.cy);
+        // 映射中的行没有间隙；自己持有的行把间隙移到光标处，光标之后的内容就是连续的
+        if (!row->mapped)
+            editorRowMoveGap(row, E.cx);
+        editorInsertRow(E.cy + 1, &row->chars[E.cx + row->gaplen], row->size - E.cx);
+        // 截断：映射中的行只需缩短视图，自己持有的行把后半部分并入间隙
+        if (row->mapped)
+            row->gap = E.cx;
+        else
+            row->gaplen += row->size - E.cx;
+        row->size = E.cx;
+        rowPullUp(row);
+        editorUpdateRow(row);
+    }
+    // 移动光标到行开头
+    E.cy++;
+    E.cx = 0;
+}
+
+void editorDelChar()
+{
+    editorLoadUntil(E.cy + 1);
+    // 如果光标超过文件内容，无需删除操作
+    if (E.cy == E.numrows)
+        return;
+    // 光标位于文件开头，不响应删除
+    if (E.cx == 0 && E.cy == 0)
+        return;
+
+    erow *row = editorRowAt(E.cy);
+
+    if (E.cx > 0)
+    {
+        // Backspace 删除光标左侧字符
+        editorRowDelChar(row, E.cx - 1);
+        E.cx--;
+    }
+    else
+    {
+        // 光标定位到上一行末尾
+        erow *prev = editorRowPrev(row);
+        E.cx = prev->size;
+        // 当前行拼接到上一行结尾
+        editorRowAppendString(prev, editorRowLinear(row), row->size);
+        // 删除当前行
+        editorDelRow(E.cy);
+        E.cy--;
+    }
+}
+
+/*** line index ***/
+
+// 换行符扫描内核：SSE2 是 x86-64 的基础指令集，AVX2 在运行时检测后使用，其它平台使用 memchr
+
+#ifdef __SSE2__
+size_t countNewlinesSSE2(const char *p, size_t n)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t count = 0, i = 0;
+    while (i + 16 <= n)
+    {
+        // 每个字节位置上的计数器最多累加 255 次，然后用 psadbw 横向求和
+        __m128i acc = _mm_setzero_si128();
+        size_t k;
+        for (k = 0; k < 255 && i + 16 <= n; k++, i += 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(v, nl));
+        }
+        __m128i sum = _mm_sad_epu8(acc, _mm_setzero_si128());
+        count += (size_t)_mm_cvtsi128_si32(sum) + (size_t)_mm_extract_epi16(sum, 4);
+    }
+    for (; i < n; i++)
+        count += p[i] == '\n';
+    return count;
+}
+
+size_t findNewlinesSSE2(const char *p, size_t n, size_t base, size_t *out)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t k = 0, i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        while (mask)
+        {
+            out[k++] = base + i + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    for (; i < n; i++)
+        if (p[i] == '\n')
+            out[k++] = base + i;
+    return k;
+}
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KILO_AVX2 1
+
+__attribute__((target("avx2"))) size_t countNewlinesAVX2(const char *p, size_t n)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t count = 0, i = 0;
+    while (i + 32 <= n)
+    {
+        __m256i acc = _mm256_setzero_si256();
+        size_t k;
+        for (k = 0; k < 255 && i + 32 <= n; k++, i += 32)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+            acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(v, nl));
+        }
+        __m256i sum = _mm256_sad_epu8(acc, _mm256_setzero_si256());
+        count += (size_t)_mm256_extract_epi64(sum, 0) + (size_t)_mm256_extract_epi64(sum, 1) +
+                 (size_t)_mm256_extract_epi64(sum, 2) + (size_t)_mm256_extract_epi64(sum, 3);
+    }
+    for (; i < n; i++)
+        count += p[i] == '\n';
+    return count;
+}
+
+__attribute__((target("avx2"))) size_t findNewlinesAVX2(const char *p, size_t n, size_t base, size_t *out)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t k = 0, i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+        while (mask)
+        {
+            out[k++] = base + i + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    for (; i < n; i++)
+        if (p[i] == '\n')
+            out[k++] = base + i;
+    return k;
+}
+#endif
+
+// CPU 是否支持 AVX2，只检测一次
+int cpuHasAVX2()
+{
+#ifdef KILO_AVX2
+    static int has = -1;
+    if (has == -1)
+    {
+        __builtin_cpu_init();
+        has = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    return has;
+#else
+    return 0;
+#endif
+}
+
+// 统计 [p, p + n) 中换行符的个数
+size_t countNewlines(const char *p, size_t n)
+{
+#ifdef KILO_AVX2
+    if (cpuHasAVX2())
+        return countNewlinesAVX2(p, n);
+#endif
+#ifdef __SSE2__
+    return countNewlinesSSE2(p, n);
+#else
+    size_t count = 0;
+    const char *end = p + n;
+    while ((p = memchr(p, '\n', end - p)) != NULL)
+    {
+        count++;
+        p++;
+    }
+    return count;
+#endif
+}
+
+// 把 [p, p + n) 中换行符的位置加上 base 依次写入 out，返回个数
+size_t findNewlines(const char *p, size_t n, size_t base, size_t *out)
+{
+#ifdef KILO_AVX2
+    if (cpuHasAVX2())
+        return findNewlinesAVX2(p, n, base, out);
+#endif
+#ifdef __SSE2__
+    return findNewlinesSSE2(p, n, base, out);
+#else
+    size_t k = 0;
+    const char *start = p, *end = p + n;
+    while ((p = memchr(p, '\n', end - p)) != NULL)
+    {
+        out[k++] = base + (p - start);
+        p++;
+    }
+    return k;
+#endif
+}
+
+/*** line index cache ***/
+
+// 文件内容的抽样散列：大小和均匀分布的若干小块，不读取整个文件
+uint64_t editorSampleHash(const char *map, size_t len)
+{
+    uint64_t h = editorHash64(&len, sizeof(len), 0);
+    size_t i;
+    for (i = 0; i <= EDITOR_CACHE_SAMPLES; i++)
+    {
+        size_t off = len / EDITOR_CACHE_SAMPLES * i;
+        if (off + EDITOR_CACHE_SAMPLE_SIZE > len)
+            off = len > EDITOR_CACHE_SAMPLE_SIZE ? len - EDITOR_CACHE_SAMPLE_SIZE : 0;
+        size_t n = len - off < EDITOR_CACHE_SAMPLE_SIZE ? len - off : EDITOR_CACHE_SAMPLE_SIZE;
+        h = editorHash64(map + off, n, h);
+    }
+    return h;
+}
+
+// 缓存文件中各部分的位置
+size_t editorCachePathSize(const struct cacheheader *h)
+{
+    return (h->pathlen + 7) & ~(size_t)7;
+}
+
+size_t editorCacheEndsOffset(const struct cacheheader *h)
+{
+    return sizeof(struct cacheheader) + editorCachePathSize(h);
+}
+
+size_t editorCacheStatesOffset(const struct cacheheader *h)
+{
+    return editorCacheEndsOffset(h) + h->nlines * sizeof(size_t);
+}
+
+// 缓存文件和被缓存文件是否对应同一份内容
+int editorCacheSameFile(const struct cacheheader *a, const struct cacheheader *b)
+{
+    return !memcmp(a->magic, b->magic, sizeof(a->magic)) && a->size == b->size &&
+           a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec &&
+           a->dev == b->dev && a->ino == b->ino && a->sample == b->sample &&
+           a->pathlen == b->pathlen;
+}
+
+// 校验映射的缓存文件：文件头、路径和大小一致，行结尾位置递增且都是换行符或文件末尾
+int editorCacheValidate(struct editorCache *c, const char *map, size_t len)
+{
+    const struct cacheheader *h = (const struct cacheheader *)c->map;
+    if (c->mapsize < sizeof(struct cacheheader) || !editorCacheSameFile(h, &c->hdr))
+        return 0;
+    // 截断或损坏的缓存文件：先确认大小容得下路径和 nlines 行的数据，再读取和计算各部分的位置
+    size_t off = editorCacheEndsOffset(h);
+    if (c->mapsize < off || memcmp(c->map + sizeof(struct cacheheader), c->file, h->pathlen) ||
+        h->nlines == 0 || h->nlines > len + 1 || h->nstates > h->nlines ||
+        h->nlines > (c->mapsize - off) / (sizeof(size_t) + sizeof(uint16_t)) ||
+        c->mapsize != editorCacheStatesOffset(h) + h->nlines * sizeof(uint16_t))
+        return 0;
+
+    const size_t *ends = (const size_t *)(c->map + editorCacheEndsOffset(h));
+    size_t i, prev = 0;
+    for (i = 0; i < h->nlines; i++)
+    {
+        if ((i > 0 && ends[i] <= prev) || ends[i] > len)
+            return 0;
+        prev = ends[i];
+    }
+    // 最后一行结束于文件末尾或最后一个换行符，其余抽样检查是否是换行符
+    if (ends[h->nlines - 1] != (map[len - 1] == '\n' ? len - 1 : len))
+        return 0;
+    for (i = 0; i < h->nlines - 1; i += h->nlines / EDITOR_CACHE_SAMPLES + 1)
+        if (map[ends[i]] != '\n')
+            return 0;
+
+    c->ends = ends;
+    c->states = (const uint16_t *)(c->map + editorCacheStatesOffset(h));
+    c->hdr.nlines = h->nlines;
+    // 高亮状态只在文件类型的 DFA 相同时使用
+    c->hdr.nstates = 0;
+    if (E.syntax && h->syntax == E.syntax->tab->fingerprint)
+    {
+        for (i = 0; i < h->nstates && c->states[i] < E.syntax->tab->nstates; i++)
+            ;
+        c->hdr.nstates = i;
+        c->hdr.syntax = h->syntax;
+    }
+    return 1;
+}
+
+// 缓存目录不存在时创建，返回 0 表示成功
+int editorCacheDir(char *dir, size_t size)
+{
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (xdg && xdg[0])
+    {
+        snprintf(dir, size, "%s", xdg);
+    }
+    else if (home && home[0])
+    {
+        snprintf(dir, size, "%s/.cache", home);
+        mkdir(dir, 0700);
+    }
+    else
+    {
+        return -1;
+    }
+    size_t n = strlen(dir);
+    snprintf(dir + n, size - n, "/kilo");
+    return mkdir(dir, 0700) == 0 || errno == EEXIST ? 0 : -1;
+}
+
+void editorCacheClose()
+{
+    struct editorCache *c = &E.cache;
+    if (c->map)
+        munmap(c->map, c->mapsize);
+    free(c->path);
+    free(c->file);
+    c->path = c->file = NULL;
+    c->map = NULL;
+    c->mapsize = 0;
+    c->ends = NULL;
+    c->states = NULL;
+    c->warm = 0;
+}
+
+// 打开文件时查找缓存：按文件算出文件头，缓存有效时映射它，行索引和高亮状态从中读取
+// 无效或不存在时只记下缓存文件的路径，加载线程扫描完成后写入
+void editorCacheOpen(const char *filename, const struct stat *st, const char *map, size_t len)
+{
+    struct editorCache *c = &E.cache;
+    editorCacheClose();
+    if (len < EDITOR_CACHE_MIN)
+        return;
+
+    char dir[1024];
+    char *file = realpath(filename, NULL);
+    if (file == NULL || editorCacheDir(dir, sizeof(dir)) != 0)
+    {
+        free(file);
+        return;
+    }
+    size_t pathlen = strlen(dir) + 32;
+    c->path = malloc(pathlen);
+    if (c->path == NULL)
+        die("malloc");
+    snprintf(c->path, pathlen, "%s/%016llx.idx", dir,
+             (unsigned long long)editorHash64(file, strlen(file), 0));
+    c->file = file;
+
+    struct cacheheader *h = &c->hdr;
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, "KILOIDX1", 8);
+    h->size = len;
+    h->mtime_sec = st->st_mtim.tv_sec;
+    h->mtime_nsec = st->st_mtim.tv_nsec;
+    h->dev = st->st_dev;
+    h->ino = st->st_ino;
+    h->sample = editorSampleHash(map, len);
+    h->pathlen = strlen(file);
+
+    int fd = open(c->path, O_RDONLY);
+    if (fd == -1)
+        return;
+    struct stat cst;
+    if (fstat(fd, &cst) == 0 && cst.st_size > 0)
+    {
+        c->mapsize = cst.st_size;
+        c->map = mmap(NULL, c->mapsize, PROT_READ, MAP_SHARED, fd, 0);
+        if (c->map == MAP_FAILED)
+            c->map = NULL;
+    }
+    close(fd);
+    if (c->map && editorCacheValidate(c, map, len))
+    {
+        c->warm = 1;
+        return;
+    }
+    if (c->map)
+        munmap(c->map, c->mapsize);
+    c->map = NULL;
+    c->mapsize = 0;
+}
+
+// 加载线程扫描完成后写入缓存：行结尾位置分成 a、b 两段，高亮状态的位置先留空
+// 先写到临时文件再改名，其它进程不会读到写了一半的缓存
+void editorCacheWrite(struct editorCache *c, const size_t *a, size_t na, const size_t *b, size_t nb)
+{
+    size_t len = strlen(c->path) + 5;
+    char *tmp = malloc(len);
+    if (tmp == NULL)
+        die("malloc");
+    snprintf(tmp, len, "%s.tmp", c->path);
+
+    struct cacheheader h = c->hdr;
+    h.nlines = na + nb;
+    h.nstates = 0;
+    h.syntax = 0;
+    char *path = calloc(1, editorCachePathSize(&h));
+    if (path == NULL)
+        die("calloc");
+    memcpy(path, c->file, h.pathlen);
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd != -1)
+    {
+        struct iovec iov[4] = {{&h, sizeof(h)},
+                               {path, editorCachePathSize(&h)},
+                               {(void *)a, na * sizeof(size_t)},
+                               {(void *)b, nb * sizeof(size_t)}};
+        off_t total = editorCacheStatesOffset(&h) + h.nlines * sizeof(uint16_t);
+        if (writevAll(fd, iov, 4) == 0 && ftruncate(fd, total) == 0 && close(fd) == 0)
+            rename(tmp, c->path);
+        else
+            unlink(tmp);
+    }
+    free(path);
+    free(tmp);
+}
+
+// 退出时把可靠的高亮状态写回缓存，只在文件没有修改并且缓存仍对应这个文件时写入
+void editorCacheSaveStates()
+{
+    struct editorCache *c = &E.cache;
+    if (c->path == NULL || E.dirty || E.loader.active || E.syntax == NULL)
+        return;
+    size_t n = E.hlvalid < E.numrows ? E.hlvalid : E.numrows;
+    if (n == 0 || (c->hdr.syntax == E.syntax->tab->fingerprint && n <= c->hdr.nstates))
+        return;
+
+    // 被缓存的文件在打开后可能被其它程序改过
+    struct stat st;
+    if (stat(E.filename, &st) != 0 || (uint64_t)st.st_size != c->hdr.size ||
+        st.st_mtim.tv_sec != c->hdr.mtime_sec || st.st_mtim.tv_nsec != c->hdr.mtime_nsec ||
+        (uint64_t)st.st_ino != c->hdr.ino)
+        return;
+
+    int fd = open(c->path, O_RDWR);
+    if (fd == -1)
+        return;
+    struct cacheheader h;
+    if (pread(fd, &h, sizeof(h), 0) == sizeof(h) && editorCacheSameFile(&h, &c->hdr) &&
+        h.nlines == E.numrows)
+    {
+        uint16_t *states = malloc(n * sizeof(uint16_t));
+        if (states == NULL)
+            die("malloc");
+        size_t i;
+        erow *row = editorRowAt(0);
+        for (i = 0; i < n; i++, row = editorRowNext(row))
+            states[i] = row->hl_state;
+        h.nstates = n;
+        h.syntax = E.syntax->tab->fingerprint;
+        if (pwrite(fd, states, n * sizeof(uint16_t), editorCacheStatesOffset(&h)) ==
+            (ssize_t)(n * sizeof(uint16_t)))
+            pwrite(fd, &h, sizeof(h), 0);
+        free(states);
+    }
+    close(fd);
+}
+
+/*** trigram index ***/
+
+// 三元组（三个字节拼成的 24 位整数）在位图中的位置
+uint32_t editorTrigramHash(uint32_t t)
+{
+    return (uint32_t)(t * 2654435761u) >> (32 - EDITOR_TRIGRAM_SHIFT);
+}
+
+// 记下在第 b 块中开始的三元组，以及从下一块开头 EDITOR_TRIGRAM_OVERLAP 字节中开始的，
+// 这样起点在这一块中的匹配，前 EDITOR_TRIGRAM_OVERLAP 个三元组都在这一块的位图中
+// 先在每位一个字节的 seen 中标记，最后再压缩成位：逐位读改写位图要慢得多
+void editorTrigramBlock(struct editorTrigram *T, size_t b, unsigned char *seen)
+{
+    uint64_t *bits = T->bits + (b << (EDITOR_TRIGRAM_SHIFT - 6));
+    const unsigned char *p = (const unsigned char *)T->map;
+    size_t start = b * EDITOR_TRIGRAM_BLOCK;
+    size_t end = start + EDITOR_TRIGRAM_BLOCK + EDITOR_TRIGRAM_OVERLAP + 2;
+    if (end > T->len)
+        end = T->len;
+    if (end - start < 3)
+        return;
+    memset(seen, 0, (size_t)1 << EDITOR_TRIGRAM_SHIFT);
+    size_t i;
+    const unsigned char *fold = T->fold;
+    for (i = start + 2; i < end; i++)
+        seen[editorTrigramHash(fold[p[i - 2]] << 16 | fold[p[i - 1]] << 8 | fold[p[i]])] = 1;
+    for (i = 0; i < (size_t)1 << (EDITOR_TRIGRAM_SHIFT - 6); i++)
+    {
+        uint64_t w = 0;
+        int k;
+        for (k = 0; k < 64; k++)
+            w |= (uint64_t)seen[i * 64 + k] << k;
+        bits[i] = w;
+    }
+}
+
+// 工作线程不断领取下一块，直到建完或者被取消
+void *editorTrigramWorker(void *arg)
+{
+    struct editorTrigram *T = arg;
+    unsigned char *seen = malloc((size_t)1 << EDITOR_TRIGRAM_SHIFT);
+    if (seen == NULL)
+        die("malloc");
+    while (1)
+    {
+        pthread_mutex_lock(&T->lock);
+        size_t b = T->next++;
+        int cancel = T->cancel;
+        pthread_mutex_unlock(&T->lock);
+        if (cancel || b >= T->nblocks)
+            break;
+        editorTrigramBlock(T, b, seen);
+        pthread_mutex_lock(&T->lock);
+        T->built++;
+        pthread_mutex_unlock(&T->lock);
+    }
+    free(seen);
+    return NULL;
+}
+
+// 在后台为映射建立三元组索引；索引只是加速查找，内存不够或者无法创建线程时不建立
+void editorTrigramStart(const char *map, size_t len)
+{
+    struct editorTrigram *T = &E.trigram;
+    T->nblocks = (len + EDITOR_TRIGRAM_BLOCK - 1) / EDITOR_TRIGRAM_BLOCK;
+    T->bits = calloc(T->nblocks << (EDITOR_TRIGRAM_SHIFT - 6), sizeof(uint64_t));
+    if (T->bits == NULL)
+        return;
+    T->map = map;
+    T->len = len;
+    T->next = T->built = 0;
+    T->cancel = 0;
+    T->ready = 0;
+    T->start = editorNow();
+    int c;
+    for (c = 0; c < 256; c++)
+        T->fold[c] = searchFold(c);
+    pthread_mutex_init(&T->lock, NULL);
+
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = ncpu < 1 ? 1 : ncpu > EDITOR_INDEX_THREADS ? EDITOR_INDEX_THREADS : ncpu;
+    T->nthreads = 0;
+    while (T->nthreads < nthreads &&
+           pthread_create(&T->threads[T->nthreads], NULL, editorTrigramWorker, T) == 0)
+        T->nthreads++;
+    if (T->nthreads == 0)
+    {
+        pthread_mutex_destroy(&T->lock);
+        free(T->bits);
+        T->bits = NULL;
+        return;
+    }
+    T->active = 1;
+}
+
+void editorTrigramJoin()
+{
+    struct editorTrigram *T = &E.trigram;
+    int i;
+    for (i = 0; i < T->nthreads; i++)
+        pthread_join(T->threads[i], NULL);
+    pthread_mutex_destroy(&T->lock);
+    T->active = 0;
+}
+
+// 停止建立并释放索引，映射被替换之前调用
+void editorTrigramStop()
+{
+    struct editorTrigram *T = &E.trigram;
+    if (T->active)
+    {
+        pthread_mutex_lock(&T->lock);
+        T->cancel = 1;
+        pthread_mutex_unlock(&T->lock);
+        editorTrigramJoin();
+    }
+    free(T->bits);
+    T->bits = NULL;
+    T->nblocks = 0;
+    T->ready = 0;
+}
+
+// 在主线程中检查是否建好，还在建立时返回 1 以便更新状态栏中的进度
+int editorTrigramPoll()
+{
+    struct editorTrigram *T = &E.trigram;
+    if (!T->active)
+        return 0;
+    pthread_mutex_lock(&T->lock);
+    size_t built = T->built;
+    pthread_mutex_unlock(&T->lock);
+    // 查找线程运行期间 ready 不变，它读取索引时不必加锁
+    if (built < T->nblocks || E.search.active)
+        return 1;
+    editorTrigramJoin();
+    T->ready = 1;
+    T->time = editorNow() - T->start;
+    return 1;
+}
+
+int editorTrigramProgress()
+{
+    struct editorTrigram *T = &E.trigram;
+    pthread_mutex_lock(&T->lock);
+    int pct = T->nblocks ? (int)((double)T->built * 100 / T->nblocks) : 100;
+    pthread_mutex_unlock(&T->lock);
+    return pct;
+}
+
+// 字面串中开始位置在前 EDITOR_TRIGRAM_OVERLAP 字节的三元组在位图中的位置，返回个数
+int editorTrigramKeys(const char *s, size_t len, uint32_t *keys)
+{
+    const unsigned char *p = (const unsigned char *)s;
+    int n = 0;
+    size_t i;
+    for (i = 0; i + 3 <= len && i < EDITOR_TRIGRAM_OVERLAP; i++)
+        keys[n++] = editorTrigramHash(searchFold(p[i]) << 16 | searchFold(p[i + 1]) << 8 |
+                                      searchFold(p[i + 2]));
+    return n;
+}
+
+// 第 b 块中是否可能有匹配的起点：字面串的三元组都在位图中
+int editorTrigramMaybe(const uint32_t *keys, int nkeys, size_t b)
+{
+    const uint64_t *bits = E.trigram.bits + (b << (EDITOR_TRIGRAM_SHIFT - 6));
+    int k;
+    for (k = 0; k < nkeys; k++)
+        if (!(bits[keys[k] >> 6] >> (keys[k] & 63) & 1))
+            return 0;
+    return 1;
+}
+
+/*** file i/o ***/
+
+// 释放当前的文件映射
+void editorUnmap()
+{
+    if (E.map == NULL)
+        return;
+    munmap(E.map, E.mapsize);
+    E.map = NULL;
+    E.mapsize = 0;
+}
+
+// 把一批行交给主线程
+void editorLoadPublish(struct editorLoader *L, struct loadbatch *b)
+{
+    b->next = NULL;
+    pthread_mutex_lock(&L->lock);
+    if (L->tail)
+        L->tail->next = b;
+    else
+        L->head = b;
+    L->tail = b;
+    pthread_cond_broadcast(&L->cond);
+    pthread_mutex_unlock(&L->lock);
+}
+
+// 索引线程：不断领取下一段，第一遍统计换行符个数，第二遍把换行符位置写到行索引中
+void *editorIndexWorker(void *arg)
+{
+    struct editorLoader *L = arg;
+    while (1)
+    {
+        pthread_mutex_lock(&L->lock);
+        size_t i = L->nextchunk++;
+        pthread_mutex_unlock(&L->lock);
+        if (i >= L->nchunks)
+            break;
+
+        struct indexchunk *c = &L->chunks[i];
+        if (L->pass == 1)
+        {
+            c->count = countNewlines(L->map + c->start, c->end - c->start);
+        }
+        else
+        {
+            findNewlines(L->map + c->start, c->end - c->start, c->start, L->index + c->base);
+            pthread_mutex_lock(&L->lock);
+            c->done = 1;
+            pthread_cond_broadcast(&L->cond);
+            pthread_mutex_unlock(&L->lock);
+        }
+    }
+    return NULL;
+}
+
+// 用最多 nthreads 个线程开始一遍扫描，返回启动的线程数，由调用者等待它们结束
+int editorIndexPass(struct editorLoader *L, int pass, pthread_t *threads, int nthreads)
+{
+    L->pass = pass;
+    L->nextchunk = 0;
+    int started = 0;
+    while (started < nthreads &&
+           pthread_create(&threads[started], NULL, editorIndexWorker, L) == 0)
+        started++;
+    // 一个线程都没能启动时在当前线程中扫描
+    if (started == 0)
+        editorIndexWorker(L);
+    return started;
+}
+
+// 加载线程：先顺序切分开头的几百行让第一屏尽快显示
+// 其余部分切成多段并行建立行索引：第一遍统计每段的换行符个数，前缀和确定每段在索引中的位置，
+// 第二遍并行填写索引，按顺序把填好的段交给主线程
+// 使用缓存的行索引时不扫描文件，直接按缓存中的行结尾位置切分批次
+void editorLoadCached(struct editorLoader *L)
+{
+    size_t first = 0;
+    while (first < L->ncached)
+    {
+        struct loadbatch *b = malloc(sizeof(struct loadbatch));
+        if (b == NULL)
+            die("malloc");
+        size_t max = first == 0 ? EDITOR_LOAD_FIRST : EDITOR_LOAD_BATCH;
+        b->n = L->ncached - first < max ? L->ncached - first : max;
+        b->ends = L->cached + first;
+        // 交给主线程后 b 随时可能被释放
+        first += b->n;
+        editorLoadPublish(L, b);
+    }
+}
+
+void *editorLoadThread(void *arg)
+{
+    struct editorLoader *L = arg;
+    size_t pos = 0;
+    if (L->cached)
+    {
+        editorLoadCached(L);
+        goto done;
+    }
+
+    struct loadbatch *b = malloc(sizeof(struct loadbatch) + sizeof(size_t) * EDITOR_LOAD_FIRST);
+    if (b == NULL)
+        die("malloc");
+    b->n = 0;
+    b->ends = b->buf;
+    while (b->n < EDITOR_LOAD_FIRST && pos < L->len)
+    {
+        const char *nl = memchr(L->map + pos, '\n', L->len - pos);
+        size_t end = nl ? (size_t)(nl - L->map) : L->len;
+        b->buf[b->n++] = end;
+        pos = nl ? end + 1 : L->len;
+    }
+    // 第一批交给主线程后就会被释放，写缓存时需要
+    size_t firstends[EDITOR_LOAD_FIRST];
+    size_t nfirst = b->n;
+    memcpy(firstends, b->buf, sizeof(size_t) * nfirst);
+    editorLoadPublish(L, b);
+
+    if (pos >= L->len)
+    {
+        if (L->cache)
+            editorCacheWrite(L->cache, firstends, nfirst, NULL, 0);
+    }
+    else
+    {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        int nthreads = ncpu < 1 ? 1 : ncpu > EDITOR_INDEX_THREADS ? EDITOR_INDEX_THREADS : ncpu;
+        pthread_t threads[EDITOR_INDEX_THREADS];
+
+        // 每个线程分到几段，段的大小限制在合理范围内
+        size_t rest = L->len - pos;
+        size_t chunk = rest / (nthreads * 4) + 1;
+        if (chunk < EDITOR_INDEX_CHUNK_MIN)
+            chunk = EDITOR_INDEX_CHUNK_MIN;
+        if (chunk > EDITOR_INDEX_CHUNK_MAX)
+            chunk = EDITOR_INDEX_CHUNK_MAX;
+        L->nchunks = (rest + chunk - 1) / chunk;
+        L->chunks = calloc(L->nchunks, sizeof(struct indexchunk));
+        if (L->chunks == NULL)
+            die("calloc");
+        size_t i;
+        for (i = 0; i < L->nchunks; i++)
+        {
+            L->chunks[i].start = pos + i * chunk;
+            L->chunks[i].end = i + 1 < L->nchunks ? pos + (i + 1) * chunk : L->len;
+        }
+
+        int started = editorIndexPass(L, 1, threads, nthreads);
+        int t;
+        for (t = 0; t < started; t++)
+            pthread_join(threads[t], NULL);
+
+        // 前缀和
+        size_t total = 0;
+        for (i = 0; i < L->nchunks; i++)
+        {
+            L->chunks[i].base = total;
+            total += L->chunks[i].count;
+        }
+        // 文件不以换行符结尾时，最后一行结束于文件末尾
+        int tail = L->map[L->len - 1] != '\n';
+        L->index = malloc(sizeof(size_t) * (total + tail + 1));
+        if (L->index == NULL)
+            die("malloc");
+        if (tail)
+            L->index[total] = L->len;
+
+        started = editorIndexPass(L, 2, threads, nthreads);
+
+        // 按顺序等待每段填好，拆成不超过 EDITOR_LOAD_BATCH 行的批次交给主线程
+        for (i = 0; i < L->nchunks; i++)
+        {
+            pthread_mutex_lock(&L->lock);
+            while (!L->chunks[i].done)
+                pthread_cond_wait(&L->cond, &L->lock);
+            pthread_mutex_unlock(&L->lock);
+
+            size_t first = L->chunks[i].base;
+            size_t last = first + L->chunks[i].count;
+            if (i + 1 == L->nchunks)
+                last += tail;
+            while (first < last)
+            {
+                b = malloc(sizeof(struct loadbatch));
+                if (b == NULL)
+                    die("malloc");
+                b->n = last - first < EDITOR_LOAD_BATCH ? last - first : EDITOR_LOAD_BATCH;
+                b->ends = L->index + first;
+                // 交给主线程后 b 随时可能被释放
+                first += b->n;
+                editorLoadPublish(L, b);
+            }
+        }
+        for (t = 0; t < started; t++)
+            pthread_join(threads[t], NULL);
+        if (L->cache)
+            editorCacheWrite(L->cache, firstends, nfirst, L->index, total + tail);
+    }
+
+done:
+    pthread_mutex_lock(&L->lock);
+    L->done = 1;
+    pthread_cond_broadcast(&L->cond);
+    pthread_mutex_unlock(&L->lock);
+    return NULL;
+}
+
+// 为一批行结尾位置创建 mapped 行，节点放在同一个数组中，建成平衡子树后接到行树末尾
+void editorAppendMappedRows(const size_t *ends, size_t n)
+{
+    struct editorLoader *L = &E.loader;
+    rownode *nodes = editorArenaBulk(sizeof(rownode) * n);
+
+    size_t i;
+    for (i = 0; i < n; i++)
+    {
+        char *p = E.map + L->next;
+        size_t linelen = ends[i] - L->next;
+        // 和 getline 读取时一样去掉行尾的回车
+        while (linelen > 0 && p[linelen - 1] == '\r')
+            linelen--;
+        L->next = ends[i] + 1;
+
+        rownode *node = &nodes[i];
+        erow *row = &node->row;
+        row->size = linelen;
+        row->chars = p;
+        row->gap = linelen;
+        row->gaplen = 0;
+        row->rsize = 0;
+        row->render = NULL;
+        row->hl = NULL;
+        row->nhl = 0;
+        row->hl_state = 0;
+        row->mapped = 1;
+    }
+
+    // 缓存的高亮状态按文件中的行号保存，加载期间插入、删除行后和 E.numrows 不再相同
+    // 前面的行都可靠，并且进入这一批时的状态和缓存中的相同时，这一批中有缓存状态的行也可靠
+    struct editorCache *c = &E.cache;
+    size_t at = L->lines;
+    for (i = 0; at + i < c->hdr.nstates && i < n; i++)
+        nodes[i].row.hl_state = c->states[at + i];
+    if (i > 0 && E.hlvalid == E.numrows)
+    {
+        erow *last = E.numrows > 0 ? editorRowAt(E.numrows - 1) : NULL;
+        int enter = last ? last->hl_state : 0;
+        if (enter == (at > 0 ? c->states[at - 1] : 0))
+            E.hlvalid = E.numrows + i;
+    }
+    L->lines += n;
+
+    // 同一批的行在映射中首尾相接，每棵子树都是 flat 的，只有合并时经过的节点需要以后再确认
+    rownode *t = rowTreeBuild(nodes, n);
+    for (i = 0; i < n; i++)
+        nodes[i].flat = 1;
+    rowTreeSetRoot(rowMerge(E.rowroot, t));
+    E.numrows += n;
+}
+
+void editorLoadFinish()
+{
+    struct editorLoader *L = &E.loader;
+    free(L->chunks);
+    free(L->index);
+    L->chunks = NULL;
+    L->index = NULL;
+    pthread_mutex_destroy(&L->lock);
+    pthread_cond_destroy(&L->cond);
+    L->active = 0;
+    E.cache.opentime = editorNow() - E.cache.start;
+    if (E.mapsize >= EDITOR_TRIGRAM_MIN)
+        editorTrigramStart(E.map, E.mapsize);
+    // 缓存的内容都已经接入行树
+    if (E.cache.map)
+    {
+        munmap(E.cache.map, E.cache.mapsize);
+        E.cache.map = NULL;
+        E.cache.mapsize = 0;
+        E.cache.ends = NULL;
+        E.cache.states = NULL;
+    }
+}
+
+// 取出加载线程切分好的批次，接入一批到行树末尾，返回接入的行数
+// 所有批次都接入并且加载线程已结束时回收线程
+size_t editorLoadIngest()
+{
+    struct editorLoader *L = &E.loader;
+    if (!L->active)
+        return 0;
+
+    pthread_mutex_lock(&L->lock);
+    if (L->head)
+    {
+        if (L->pendtail)
+            L->pendtail->next = L->head;
+        else
+            L->pending = L->head;
+        L->pendtail = L->tail;
+        L->head = L->tail = NULL;
+    }
+    int done = L->done;
+    pthread_mutex_unlock(&L->lock);
+
+    struct loadbatch *b = L->pending;
+    if (b == NULL)
+    {
+        if (done)
+        {
+            pthread_join(L->thread, NULL);
+            editorLoadFinish();
+        }
+        return 0;
+    }
+
+    L->pending = b->next;
+    if (L->pending == NULL)
+        L->pendtail = NULL;
+    size_t n = b->n;
+    editorAppendMappedRows(b->ends, n);
+    free(b);
+    return n;
+}
+
+// 等待加载到至少 nrows 行（或者加载结束），只等待需要的那一部分
+void editorLoadUntil(size_t nrows)
+{
+    struct editorLoader *L = &E.loader;
+    while (L->active && E.numrows < nrows)
+    {
+        if (editorLoadIngest() > 0 || !L->active)
+            continue;
+        pthread_mutex_lock(&L->lock);
+        while (L->head == NULL && !L->done)
+            pthread_cond_wait(&L->cond, &L->lock);
+        pthread_mutex_unlock(&L->lock);
+    }
+}
+
+// 加载进度百分比，按已接入行树的部分计算
+int editorLoadProgress()
+{
+    struct editorLoader *L = &E.loader;
+    return L->len ? (int)((double)L->next * 100 / L->len) : 100;
+}
+
+// 在后台切分映射内容，每行只记录其在映射中的位置
+void editorMapRows(char *map, size_t len)
+{
+    struct editorLoader *L = &E.loader;
+    E.map = map;
+    E.mapsize = len;
+
+    L->map = map;
+    L->len = len;
+    L->head = L->tail = NULL;
+    L->pending = L->pendtail = NULL;
+    L->done = 0;
+    L->chunks = NULL;
+    L->nchunks = 0;
+    L->index = NULL;
+    L->next = 0;
+    L->lines = 0;
+    L->cache = E.cache.path && !E.cache.warm ? &E.cache : NULL;
+    L->cached = E.cache.warm ? E.cache.ends : NULL;
+    L->ncached = E.cache.warm ? E.cache.hdr.nlines : 0;
+    pthread_mutex_init(&L->lock, NULL);
+    pthread_cond_init(&L->cond, NULL);
+    L->active = 1;
+    if (pthread_create(&L->thread, NULL, editorLoadThread, L) != 0)
+    {
+        // 无法创建线程时直接在当前线程中切分
+        editorLoadThread(L);
+        while (L->head)
+        {
+            struct loadbatch *next = L->head->next;
+            editorAppendMappedRows(L->head->ends, L->head->n);
+            free(L->head);
+            L->head = next;
+        }
+        editorLoadFinish();
+    }
+}
+
+// 让所有行改为引用 base，base 的内容必须和各行加换行符拼接后完全一致
+void editorRebaseRows(char *base, size_t len)
+{
+    size_t off = 0;
+    erow *row;
+    for (row = editorRowAt(0); row; row = editorRowNext(row))
+    {
+        editorRowDropShared(row);
+        if (!row->mapped)
+            editorArenaFree(row->chars, row->size + row->gaplen);
+        row->chars = base + off;
+        row->gap = row->size;
+        row->gaplen = 0;
+        row->mapped = 1;
+        // 所有行在新的映射中首尾相接
+        ((rownode *)row)->flat = 1;
+        off += row->size + 1;
+    }
+
+    editorTrigramStop();
+    editorUnmap();
+    E.map = base;
+    E.mapsize = len;
+    if (len >= EDITOR_TRIGRAM_MIN)
+        editorTrigramStart(base, len);
+}
+
+void editorOpen(char *filename)
+{
+    E.cache.start = editorNow();
+    E.cache.opentime = 0;
+    free(E.filename);
+    // strdup 自动分配内存并复制字符串
+    E.filename = strdup(filename);
+
+    editorSelectSyntaxHighlight();
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+        die("open");
+
+    // 普通文件直接映射到内存，不逐行复制
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+    {
+        if (st.st_size == 0)
+        {
+            close(fd);
+            return;
+        }
+        char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            close(fd);
+            editorCacheOpen(filename, &st, map, st.st_size);
+            editorMapRows(map, st.st_size);
+            E.dirty = 0;
+            return;
+        }
+    }
+
+    // 无法映射时（管道、设备等）逐行读取
+    FILE *fp = fdopen(fd, "r");
+    if (!fp)
+        die("fdopen");
+
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    // 循环读入行，getline 到达文件末尾时返回 -1
+    // getline 自动为 line 分配内存，分配大小写入 linecap，是行的长度
+    while ((linelen = getline(&line, &linecap, fp)) != -1)
+    {
+        // 去掉换行回车，因为编辑器每行都表示一行文本
+        while (linelen > 0 && (line[linelen - 1] == '\n' ||
+                               line[linelen - 1] == '\r'))
+            linelen--;
+
+        editorInsertRow(E.numrows, line, linelen);
+    }
+    free(line);
+    fclose(fp);
+
+    // 由于打开文件时会调用 editorInsertRow() 修改了脏位，需要重置
+    E.dirty = 0;
+}
+
+// 写出 iov 中的全部数据，处理 writev 只写入了一部分的情况
+int writevAll(int fd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0)
+    {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        // 跳过已经写完的 iovec，调整写了一半的那个
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// 把 len 字节接到快照末尾，和上一个片段在内存中相连时直接合并
+void editorSnapshotAppend(struct editorSaveJob *job, char *p, size_t len)
+{
+    struct iovec *last = job->nsegs ? &job->segs[job->nsegs - 1] : NULL;
+    job->total += len;
+    if (last && (char *)last->iov_base + last->iov_len == p)
+    {
+        last->iov_len += len;
+        return;
+    }
+    if (job->nsegs == job->segcap)
+    {
+        job->segcap = job->segcap ? job->segcap * 2 : 64;
+        job->segs = realloc(job->segs, sizeof(struct iovec) * job->segcap);
+        if (job->segs == NULL)
+            die("realloc");
+    }
+    job->segs[job->nsegs].iov_base = p;
+    job->segs[job->nsegs].iov_len = len;
+    job->nsegs++;
+}
+
+// 复制一行内容并在末尾加上换行符，副本在保存期间保持不变
+char *editorSnapshotCopy(struct editorSaveJob *job, erow *row)
+{
+    size_t len = row->size;
+    struct saveblock *b = job->blocks;
+    if (b == NULL || b->cap - b->used < len + 1)
+    {
+        size_t cap = len + 1 > EDITOR_SAVE_BLOCK ? len + 1 : EDITOR_SAVE_BLOCK;
+        b = malloc(sizeof(struct saveblock) + cap);
+        if (b == NULL)
+            die("malloc");
+        b->next = job->blocks;
+        b->used = 0;
+        b->cap = cap;
+        job->blocks = b;
+    }
+    char *p = &b->data[b->used];
+    // 间隙两侧分别复制，不移动间隙
+    memcpy(p, row->chars, row->gap);
+    memcpy(p + row->gap, &row->chars[row->gap + row->gaplen], len - row->gap);
+    p[len] = '\n';
+    b->used += len + 1;
+    return p;
+}
+
+// 为所有行拍一个写时复制的快照
+// 映射中的行直接引用映射（保存结束前映射不会被释放），修改过的行复制一份
+void editorSnapshotRows(struct editorSaveJob *job)
+{
+    static char newline = '\n';
+    erow *row;
+    for (row = editorRowAt(0); row; row = editorRowNext(row))
+    {
+        if (row->mapped)
+        {
+            // 映射中的行后面紧跟着换行符时，连同换行符一起引用
+            int span = row->chars + row->size < E.map + E.mapsize &&
+                       row->chars[row->size] == '\n';
+            editorSnapshotAppend(job, row->chars, row->size + span);
+            if (!span)
+                editorSnapshotAppend(job, &newline, 1);
+        }
+        else
+        {
+            editorSnapshotAppend(job, editorSnapshotCopy(job, row), row->size + 1);
+        }
+    }
+}
+
+// 同步 path 所在的目录，确保 rename 的结果落盘
+void editorSyncDir(const char *path)
+{
+    char *dir = strdup(path);
+    char *slash = strrchr(dir, '/');
+    if (slash == dir)
+        slash[1] = '\0';
+    else if (slash)
+        *slash = '\0';
+    else
+        strcpy(dir, ".");
+
+    int fd = open(dir, O_RDONLY);
+    if (fd != -1)
+    {
+        fsync(fd);
+        close(fd);
+    }
+    free(dir);
+}
+
+// 保存线程：把快照写入临时文件，fsync 后 rename 覆盖目标文件
+// 保存中途出错或崩溃时原文件保持不变；符号链接替换的是它指向的文件
+// 原地保存时临时文件留给主线程复制回原文件
+void *editorSaveThread(void *arg)
+{
+    struct editorSaveJob *job = arg;
+    char *tmp = malloc(strlen(job->path) + 16);
+
+    char *map = NULL;
+    int err = 0;
+    int fd = -1;
+    if (tmp == NULL)
+    {
+        err = ENOMEM;
+    }
+    else
+    {
+        sprintf(tmp, "%s.kiloXXXXXX", job->path);
+        fd = mkstemp(tmp);
+        if (fd == -1)
+            err = errno;
+    }
+    if (fd != -1)
+    {
+        // 沿用原文件的属主、属组和权限，新文件使用 0644
+        struct stat st;
+        mode_t mode;
+        if (stat(job->path, &st) == 0)
+        {
+            // 不是 root 时通常只能改属组，都改不了时保持当前用户
+            if (fchown(fd, st.st_uid, st.st_gid) == -1 &&
+                fchown(fd, (uid_t)-1, st.st_gid) == -1)
+                errno = 0;
+            mode = st.st_mode & 07777;
+        }
+        else
+        {
+            mode_t mask = umask(0);
+            umask(mask);
+            mode = 0644 & ~mask;
+        }
+        if (fchmod(fd, mode) == -1)
+            err = errno;
+
+        int i;
+        for (i = 0; !err && i < job->nsegs; i += EDITOR_SAVE_IOV)
+        {
+            int cnt = job->nsegs - i < EDITOR_SAVE_IOV ? job->nsegs - i : EDITOR_SAVE_IOV;
+            size_t bytes = 0;
+            int j;
+            for (j = 0; j < cnt; j++)
+                bytes += job->segs[i + j].iov_len;
+            if (writevAll(fd, &job->segs[i], cnt) == -1)
+            {
+                err = errno;
+                break;
+            }
+            pthread_mutex_lock(&job->lock);
+            job->written += bytes;
+            pthread_mutex_unlock(&job->lock);
+        }
+
+        if (!err && (fsync(fd) == -1 || (!job->inplace && rename(tmp, job->path) == -1)))
+            err = errno;
+        if (!err)
+        {
+            if (!job->inplace)
+                editorSyncDir(job->path);
+            // 映射新文件，没有继续编辑时主线程让各行改为引用它
+            if (job->total > 0)
+            {
+                map = mmap(NULL, job->total, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (map == MAP_FAILED)
+                    map = NULL;
+            }
+        }
+        else
+        {
+            unlink(tmp);
+        }
+        close(fd);
+    }
+    if (job->inplace && !err)
+        job->tmp = tmp;
+    else
+        free(tmp);
+
+    pthread_mutex_lock(&job->lock);
+    job->err = err;
+    job->map = map;
+    job->done = 1;
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+// 把临时文件的内容复制回原文件，返回 0 或 errno
+// 先让各行改为引用临时文件的映射，原来的映射解除后才能改写原文件
+int editorSaveInPlace(struct editorSaveJob *job)
+{
+    if (job->map == NULL && job->total > 0)
+    {
+        // 无法映射临时文件时各行还引用着原文件，只能 rename，硬链接会断开
+        if (rename(job->tmp, job->path) == -1)
+            return errno;
+        free(job->tmp);
+        job->tmp = NULL;
+        editorSyncDir(job->path);
+        return 0;
+    }
+    struct iovec iov = {job->map, job->total};
+    editorRebaseRows(job->map, job->total);
+    job->map = NULL;
+
+    int fd = open(job->path, O_WRONLY);
+    if (fd == -1)
+        return errno;
+    int err = 0;
+    if ((job->total > 0 && writevAll(fd, &iov, 1) == -1) ||
+        ftruncate(fd, job->total) == -1 || fsync(fd) == -1)
+        err = errno;
+    close(fd);
+    if (err)
+        return err;
+    unlink(job->tmp);
+    free(job->tmp);
+    job->tmp = NULL;
+    return 0;
+}
+
+// 在主线程中收尾：核对脏位并报告结果
+void editorSaveFinish()
+{
+    struct editorSaveJob *job = &E.save;
+    job->active = 0;
+
+    if (job->err == 0 && job->inplace)
+        job->err = editorSaveInPlace(job);
+    if (job->err == 0)
+    {
+        // 保存期间没有新的修改时，各行改为引用新文件，释放修改过的行
+        if (job->map)
+        {
+            if (E.dirty == job->dirty)
+                editorRebaseRows(job->map, job->total);
+            else
+                munmap(job->map, job->total);
+        }
+        // 只清除快照之前的修改
+        E.dirty -= job->dirty;
+
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double secs = (end.tv_sec - job->start.tv_sec) + (end.tv_nsec - job->start.tv_nsec) / 1e9;
+        if (secs <= 0)
+            secs = 1e-9;
+        editorSetStatusMessage("%zu bytes written to disk (%.1f MB/s)",
+                               job->total, job->total / secs / 1e6);
+    }
+    else if (job->tmp)
+    {
+        // 原文件可能只改写了一部分，完整的内容还在同一目录下的临时文件中
+        const char *slash = strrchr(job->tmp, '/');
+        editorSetStatusMessage("Can't save! %s, copy kept in %s",
+                               strerror(job->err), slash ? slash + 1 : job->tmp);
+    }
+    else
+    {
+        editorSetStatusMessage("Can't save! I/O error: %s", strerror(job->err));
+    }
+
+    while (job->blocks)
+    {
+        struct saveblock *next = job->blocks->next;
+        free(job->blocks);
+        job->blocks = next;
+    }
+    free(job->segs);
+    free(job->path);
+    free(job->tmp);
+    job->segs = NULL;
+    job->path = NULL;
+    job->tmp = NULL;
+    pthread_mutex_destroy(&job->lock);
+}
+
+// 等待后台保存结束并收尾
+void editorSaveWait()
+{
+    if (!E.save.active)
+        return;
+    pthread_join(E.save.thread, NULL);
+    editorSaveFinish();
+}
+
+// 保存进度百分比
+int editorSaveProgress()
+{
+    struct editorSaveJob *job = &E.save;
+    pthread_mutex_lock(&job->lock);
+    int pct = job->total ? (int)((double)job->written * 100 / job->total) : 100;
+    pthread_mutex_unlock(&job->lock);
+    return pct;
+}
+
+void editorSave()
+{
+    struct editorSaveJob *job = &E.save;
+    if (job->active)
+    {
+        editorSetStatusMessage("Save already in progress");
+        return;
+    }
+
+    if (E.filename == NULL)
+    {
+        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL, 0);
+        if (E.filename == NULL)
+        {
+            editorSetStatusMessage("Save aborted");
+            return;
+        }
+        editorSelectSyntaxHighlight();
+    }
+
+    // 快照需要完整的文件
+    editorLoadUntil(SIZE_MAX);
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+
+    job->path = realpath(E.filename, NULL);
+    if (job->path == NULL)
+        job->path = strdup(E.filename);
+    job->nsegs = job->segcap = 0;
+    job->total = job->written = 0;
+    job->done = job->err = 0;
+    job->map = NULL;
+    job->tmp = NULL;
+    job->dirty = E.dirty;
+    // rename 会断开硬链接，这时改为原地保存
+    struct stat st;
+    job->inplace = stat(job->path, &st) == 0 && st.st_nlink > 1;
+    editorSnapshotRows(job);
+
+    // 写文件放到后台线程，期间可以继续编辑
+    pthread_mutex_init(&job->lock, NULL);
+    job->active = 1;
+    // 原地保存要求临时文件写好时各行没有再修改，同步进行
+    // 无法创建线程时也退回同步保存
+    if (job->inplace || pthread_create(&job->thread, NULL, editorSaveThread, job) != 0)
+    {
+        editorSaveThread(job);
+        editorSaveFinish();
+        return;
+    }
+    editorSetStatusMessage("Saving in the background...");
+}
+
+/*** regex ***/
+
+// 解析正则表达式得到的语法树节点
+struct rxast
+{
+    unsigned char type; // RXA_*
+    int a, b;           // 子节点
+    int min, max;       // RXA_REPEAT 的次数，max 为 -1 表示不限
+    int set;            // RXA_SET 的字节集合
+};
+
+struct rxparse
+{
+    const char *p;
+    struct rxast *ast;
+    int nast, astcap;
+    unsigned char (*sets)[32];
+    int nsets, setcap;
+    int icase;
+    int depth; // 当前所在的括号层数
+    const char *error;
+};
+
+int rxAst(struct rxparse *P, int type, int a, int b)
+{
+    if (P->nast == P->astcap)
+    {
+        P->astcap = P->astcap ? P->astcap * 2 : 64;
+        P->ast = realloc(P->ast, sizeof(struct rxast) * P->astcap);
+        if (P->ast == NULL)
+            die("realloc");
+    }
+    struct rxast *n = &P->ast[P->nast];
+    n->type = type;
+    n->a = a;
+    n->b = b;
+    n->min = n->max = 0;
+    n->set = -1;
+    return P->nast++;
+}
+
+// 新建一个空的字节集合
+int rxSet(struct rxparse *P)
+{
+    if (P->nsets == P->setcap)
+    {
+        P->setcap = P->setcap ? P->setcap * 2 : 16;
+        P->sets = realloc(P->sets, 32 * P->setcap);
+        if (P->sets == NULL)
+            die("realloc");
+    }
+    memset(P->sets[P->nsets], 0, 32);
+    return P->nsets++;
+}
+
+void rxSetAdd(unsigned char *set, int c)
+{
+    set[c >> 3] |= 1 << (c & 7);
+}
+
+int rxSetHas(const unsigned char *set, int c)
+{
+    return set[c >> 3] & (1 << (c & 7));
+}
+
+// \d \w \s 等简写的字节集合，不是简写时返回 0
+int rxSetClass(unsigned char *set, int c)
+{
+    int k, neg = isupper(c);
+    unsigned char tmp[32];
+    memset(tmp, 0, sizeof(tmp));
+    switch (tolower(c))
+    {
+    case 'd':
+        for (k = '0'; k <= '9'; k++)
+            rxSetAdd(tmp, k);
+        break;
+    case 'w':
+        for (k = 0; k < 256; k++)
+            if (isalnum(k) || k == '_')
+                rxSetAdd(tmp, k);
+        break;
+    case 's':
+        for (k = 0; k < 256; k++)
+            if (isspace(k))
+                rxSetAdd(tmp, k);
+        break;
+    default:
+        return 0;
+    }
+    for (k = 0; k < 32; k++)
+        set[k] |= neg ? ~tmp[k] : tmp[k];
+    return 1;
+}
+
+// 转义的单个字节：\t \n \r \f \v 以及其他字符本身，字母和数字不能随意转义
+int rxEscape(struct rxparse *P, int c)
+{
+    switch (c)
+    {
+    case 't':
+        return '\t';
+    case 'n':
+        return '\n';
+    case 'r':
+        return '\r';
+    case 'f':
+        return '\f';
+    case 'v':
+        return '\v';
+    }
+    if (c == '\0' || isalnum(c))
+    {
+        P->error = "bad escape";
+        return -1;
+    }
+    return c;
+}
+
+// 忽略大小写时把集合中的字母补全两种大小写
+void rxSetFold(struct rxparse *P, int set)
+{
+    if (!P->icase)
+        return;
+    unsigned char *s = P->sets[set];
+    int c;
+    for (c = 'a'; c <= 'z'; c++)
+        if (rxSetHas(s, c) || rxSetHas(s, c - 32))
+        {
+            rxSetAdd(s, c);
+            rxSetAdd(s, c - 32);
+        }
+}
+
+int rxParseAlt(struct rxparse *P);
+
+// [...] 字符类
+int rxParseClass(struct rxparse *P)
+{
+    int set = rxSet(P);
+    int neg = 0;
+    if (*P->p == '^')
+    {
+        neg = 1;
+        P->p++;
+    }
+    int first = 1;
+    while (*P->p != ']' || first)
+    {
+        first = 0;
+        int c = (unsigned char)*P->p++;
+        if (c == '\0')
+        {
+            P->error = "missing ]";
+            return -1;
+        }
+        if (c == '\\')
+        {
+            c = (unsigned char)*P->p++;
+            if (rxSetClass(P->sets[set], c))
+                continue;
+            if ((c = rxEscape(P, c)) < 0)
+                return -1;
+        }
+        int hi = c;
+        if (P->p[0] == '-' && P->p[1] != ']' && P->p[1] != '\0')
+        {
+            P->p++;
+            hi = (unsigned char)*P->p++;
+            if (hi == '\\' && (hi = rxEscape(P, (unsigned char)*P->p++)) < 0)
+                return -1;
+            if (hi < c)
+            {
+                P->error = "bad range";
+                return -1;
+            }
+        }
+        for (; c <= hi; c++)
+            rxSetAdd(P->sets[set], c);
+    }
+    P->p++;
+    rxSetFold(P, set);
+    if (neg)
+    {
+        int k;
+        for (k = 0; k < 32; k++)
+            P->sets[set][k] = ~P->sets[set][k];
+    }
+    int n = rxAst(P, RXA_SET, -1, -1);
+    P->ast[n].set = set;
+    return n;
+}
+
+int rxParseAtom(struct rxparse *P)
+{
+    int c = (unsigned char)*P->p++;
+    int n, set;
+    switch (c)
+    {
+    case '(':
+        if (P->depth == EDITOR_REGEX_DEPTH)
+        {
+            P->error = "too deeply nested";
+            return -1;
+        }
+        if (P->p[0] == '?' && P->p[1] == ':')
+            P->p += 2;
+        P->depth++;
+        n = rxParseAlt(P);
+        P->depth--;
+        if (n < 0)
+            return -1;
+        if (*P->p != ')')
+        {
+            P->error = "missing )";
+            return -1;
+        }
+        P->p++;
+        return n;
+    case ')':
+        P->error = "unmatched )";
+        return -1;
+    case '*':
+    case '+':
+    case '?':
+    case '{':
+        P->error = "nothing to repeat";
+        return -1;
+    case '^':
+        return rxAst(P, RXA_BOL, -1, -1);
+    case '$':
+        return rxAst(P, RXA_EOL, -1, -1);
+    case '[':
+        return rxParseClass(P);
+    }
+    set = rxSet(P);
+    if (c == '.')
+    {
+        memset(P->sets[set], 0xff, 32);
+    }
+    else if (c == '\\')
+    {
+        c = (unsigned char)*P->p++;
+        if (!rxSetClass(P->sets[set], c))
+        {
+            if ((c = rxEscape(P, c)) < 0)
+                return -1;
+            rxSetAdd(P->sets[set], c);
+        }
+    }
+    else
+    {
+        rxSetAdd(P->sets[set], c);
+    }
+    rxSetFold(P, set);
+    n = rxAst(P, RXA_SET, -1, -1);
+    P->ast[n].set = set;
+    return n;
+}
+
+// {m}、{m,}、{m,n} 中的数字
+int rxParseCount(struct rxparse *P)
+{
+    if (!isdigit((unsigned char)*P->p))
+        return -1;
+    int n = 0;
+    while (isdigit((unsigned char)*P->p))
+    {
+        n = n * 10 + (*P->p++ - '0');
+        if (n > EDITOR_REGEX_REPEAT)
+            return -1;
+    }
+    return n;
+}
+
+int rxParseRepeat(struct rxparse *P)
+{
+    int a = rxParseAtom(P);
+    while (a >= 0 && (*P->p == '*' || *P->p == '+' || *P->p == '?' || *P->p == '{'))
+    {
+        int min = 0, max = -1;
+        char c = *P->p++;
+        if (c == '+')
+            min = 1;
+        else if (c == '?')
+            max = 1;
+        else if (c == '{')
+        {
+            min = max = rxParseCount(P);
+            if (*P->p == ',')
+            {
+                P->p++;
+                max = *P->p == '}' ? -1 : rxParseCount(P);
+                if (max == -1 && *P->p != '}')
+                    min = -1;
+            }
+            if (min < 0 || *P->p != '}' || (max >= 0 && max < min))
+            {
+                P->error = "bad repeat";
+                return -1;
+            }
+            P->p++;
+        }
+        // 总是找最长匹配，非贪婪的写法和贪婪的相同
+        if (*P->p == '?')
+            P->p++;
+        int n = rxAst(P, RXA_REPEAT, a, -1);
+        P->ast[n].min = min;
+        P->ast[n].max = max;
+        a = n;
+    }
+    return a;
+}
+
+int rxParseCat(struct rxparse *P)
+{
+    int a = -1;
+    while (*P->p != '\0' && *P->p != '|' && *P->p != ')')
+    {
+        int b = rxParseRepeat(P);
+        if (b < 0)
+            return -1;
+        a = a < 0 ? b : rxAst(P, RXA_CAT, a, b);
+    }
+    return a < 0 ? rxAst(P, RXA_EMPTY, -1, -1) : a;
+}
+
+int rxParseAlt(struct rxparse *P)
+{
+    int a = rxParseCat(P);
+    while (a >= 0 && *P->p == '|')
+    {
+        P->p++;
+        int b = rxParseCat(P);
+        if (b < 0)
+            return -1;
+        a = rxAst(P, RXA_ALT, a, b);
+    }
+    return a;
+}
+
+// 最外层连接中的一串单个字节
+struct rxliteral
+{
+    char best[EDITOR_REGEX_LITERAL], cur[EDITOR_REGEX_LITERAL];
+    int nbest, ncur;
+};
+
+// 集合只含一个字节（忽略大小写时是一个字母的两种大小写）时返回这个字节，否则返回 -1
+int rxLiteralByte(const unsigned char *set, int icase)
+{
+    int c, found = -1;
+    for (c = 0; c < 256; c++)
+    {
+        if (!rxSetHas(set, c) || (icase && c >= 'A' && c <= 'Z'))
+            continue;
+        if (found >= 0 || c == '\n')
+            return -1;
+        found = c;
+    }
+    return found;
+}
+
+void rxLiteralPush(struct rxliteral *L, int c)
+{
+    if (L->ncur == EDITOR_REGEX_LITERAL - 1)
+        return;
+    L->cur[L->ncur++] = c;
+    if (L->ncur > L->nbest)
+    {
+        L->nbest = L->ncur;
+        memcpy(L->best, L->cur, L->ncur);
+    }
+}
+
+// 按从左到右的顺序处理连接的各部分，不是单个字节的部分打断当前这一串
+void rxLiteralWalk(const struct rxparse *P, int n, struct rxliteral *L)
+{
+    const struct rxast *a = &P->ast[n];
+    int c, i;
+    if (a->type == RXA_CAT)
+    {
+        rxLiteralWalk(P, a->a, L);
+        rxLiteralWalk(P, a->b, L);
+        return;
+    }
+    if (a->type == RXA_SET && (c = rxLiteralByte(P->sets[a->set], P->icase)) >= 0)
+    {
+        rxLiteralPush(L, c);
+        return;
+    }
+    // x{m,n} 至少有 m 个 x：前面的一串接上 m 个 x，后面的一串从最后一个 x 开始
+    if (a->type == RXA_REPEAT && a->min >= 1 && P->ast[a->a].type == RXA_SET &&
+        (c = rxLiteralByte(P->sets[P->ast[a->a].set], P->icase)) >= 0)
+    {
+        for (i = 0; i < a->min; i++)
+            rxLiteralPush(L, c);
+        if (a->max != a->min)
+        {
+            L->ncur = 0;
+            rxLiteralPush(L, c);
+        }
+        return;
+    }
+    L->ncur = 0;
+}
+
+int rxNode(struct regexprog *g, int op, int set, int out, int out1)
+{
+    if (g->nnodes == EDITOR_REGEX_NODES)
+        return -1;
+    struct rxnode *n = &g->nodes[g->nnodes];
+    n->op = op;
+    n->set = set;
+    n->out = out;
+    n->out1 = out1;
+    return g->nnodes++;
+}
+
+// 由语法树生成 NFA：返回匹配 ast 之后接着走到 next 的起始节点，节点用完时返回 -1
+// reverse 时生成从右向左读取的 NFA：连接的顺序颠倒，^ 和 $ 交换
+int rxEmit(struct regexprog *g, const struct rxast *ast, int n, int next, int reverse)
+{
+    if (next < 0)
+        return -1;
+    const struct rxast *a = &ast[n];
+    int i, c, body;
+    switch (a->type)
+    {
+    case RXA_EMPTY:
+        return next;
+    case RXA_SET:
+        return rxNode(g, RX_SET, a->set, next, -1);
+    case RXA_BOL:
+        return rxNode(g, reverse ? RX_END : RX_START, -1, next, -1);
+    case RXA_EOL:
+        return rxNode(g, reverse ? RX_START : RX_END, -1, next, -1);
+    case RXA_CAT:
+        if (reverse)
+            return rxEmit(g, ast, a->b, rxEmit(g, ast, a->a, next, reverse), reverse);
+        return rxEmit(g, ast, a->a, rxEmit(g, ast, a->b, next, reverse), reverse);
+    case RXA_ALT:
+        body = rxEmit(g, ast, a->a, next, reverse);
+        c = rxEmit(g, ast, a->b, next, reverse);
+        return body < 0 || c < 0 ? -1 : rxNode(g, RX_SPLIT, -1, body, c);
+    case RXA_REPEAT:
+        // 可选的部分从后向前生成：每一次都可以接着重复，也可以直接走到 next
+        c = next;
+        if (a->max < 0)
+        {
+            c = rxNode(g, RX_SPLIT, -1, -1, next);
+            if (c < 0 || (body = rxEmit(g, ast, a->a, c, reverse)) < 0)
+                return -1;
+            g->nodes[c].out = body;
+        }
+        for (i = a->min; i < a->max && c >= 0; i++)
+        {
+            body = rxEmit(g, ast, a->a, c, reverse);
+            c = body < 0 ? -1 : rxNode(g, RX_SPLIT, -1, body, next);
+        }
+        for (i = 0; i < a->min && c >= 0; i++)
+            c = rxEmit(g, ast, a->a, c, reverse);
+        return c;
+    }
+    return -1;
+}
+
+// 从 ids 出发沿空转移扩展，结果按节点编号排序写入 out，返回个数
+// atstart/atend 表示当前位置是否是读取方向上的行首/行尾，不满足的 RX_END 留在集合中等到行尾再判断
+int rxClosure(struct regex *r, const int *ids, int n, int atstart, int atend, int *out)
+{
+    const struct regexprog *g = r->prog;
+    if (++r->gen == 0)
+    {
+        memset(r->mark, 0, sizeof(unsigned int) * g->nnodes);
+        r->gen = 1;
+    }
+    int top = 0, k = 0, i;
+    for (i = 0; i < n; i++)
+        r->stack[top++] = ids[i];
+    while (top > 0)
+    {
+        int id = r->stack[--top];
+        if (id < 0 || r->mark[id] == r->gen)
+            continue;
+        r->mark[id] = r->gen;
+        const struct rxnode *node = &g->nodes[id];
+        switch (node->op)
+        {
+        case RX_SPLIT:
+            r->stack[top++] = node->out1;
+            r->stack[top++] = node->out;
+            break;
+        case RX_START:
+            if (atstart)
+                r->stack[top++] = node->out;
+            break;
+        case RX_END:
+            if (atend)
+                r->stack[top++] = node->out;
+            else
+                out[k++] = id;
+            break;
+        default:
+            out[k++] = id;
+        }
+    }
+    // 集合很小，插入排序即可
+    for (i = 1; i < k; i++)
+    {
+        int v = out[i], j = i;
+        while (j > 0 && out[j - 1] > v)
+        {
+            out[j] = out[j - 1];
+            j--;
+        }
+        out[j] = v;
+    }
+    return k;
+}
+
+int rxHasMatch(const struct regexprog *g, const int *ids, int n)
+{
+    int i;
+    for (i = 0; i < n; i++)
+        if (g->nodes[ids[i]].op == RX_MATCH)
+            return 1;
+    return 0;
+}
+
+void rxDfaFlush(struct regexdfa *d)
+{
+    d->flushes++;
+    d->nstates = 0;
+    d->npool = 0;
+    memset(d->hash, -1, sizeof(int) * (d->hashmask + 1));
+    d->start[0] = d->start[1] = -1;
+}
+
+// 查找或者新建 NFA 节点集合对应的 DFA 状态；缓存满了就整个清空，之前的状态编号全部失效
+int rxDfaState(struct regex *r, struct regexdfa *d, const int *ids, int n)
+{
+    uint64_t h = editorHash64((const char *)ids, sizeof(int) * n, 0);
+    size_t slot = h & d->hashmask;
+    int s;
+    while ((s = d->hash[slot]) >= 0)
+    {
+        struct rxstate *st = &d->states[s];
+        if (st->n == n && memcmp(&d->pool[st->off], ids, sizeof(int) * n) == 0)
+            return s;
+        slot = (slot + 1) & d->hashmask;
+    }
+    if (d->nstates == EDITOR_REGEX_STATES)
+    {
+        rxDfaFlush(d);
+        return rxDfaState(r, d, ids, n);
+    }
+    if (d->npool + n > d->poolcap)
+    {
+        d->poolcap = (d->npool + n) * 2;
+        d->pool = realloc(d->pool, sizeof(int) * d->poolcap);
+        if (d->pool == NULL)
+            die("realloc");
+    }
+    s = d->nstates++;
+    struct rxstate *st = &d->states[s];
+    st->off = d->npool;
+    st->n = n;
+    memcpy(&d->pool[d->npool], ids, sizeof(int) * n);
+    d->npool += n;
+    memset(&d->next[s * 256], -1, sizeof(int) * 256);
+    st->accept = rxHasMatch(r->prog, ids, n);
+    // 行尾时还能满足集合中留下的 $
+    int m = rxClosure(r, ids, n, 0, 1, r->tmp);
+    st->endaccept = rxHasMatch(r->prog, r->tmp, m);
+    d->hash[slot] = s;
+    return s;
+}
+
+// 读取方向上的起始状态，atstart 表示从行首（反向时是行尾）开始
+int rxDfaStart(struct regex *r, struct regexdfa *d, int atstart)
+{
+    if (d->start[atstart] < 0)
+    {
+        int n = rxClosure(r, &d->entry, 1, atstart, 0, r->list);
+        d->start[atstart] = rxDfaState(r, d, r->list, n);
+    }
+    return d->start[atstart];
+}
+
+// 状态 s 读入字节 c 之后的状态，没有缓存时由 NFA 计算
+int rxDfaStep(struct regex *r, struct regexdfa *d, int s, unsigned char c)
+{
+    int next = d->next[s * 256 + c];
+    if (next >= 0)
+        return next >> 8;
+    const struct regexprog *g = r->prog;
+    const struct rxstate *st = &d->states[s];
+    int i, k = 0;
+    for (i = 0; i < st->n; i++)
+    {
+        const struct rxnode *node = &g->nodes[d->pool[st->off + i]];
+        if (node->op == RX_SET && rxSetHas(g->sets[node->set], c))
+            r->ids[k++] = node->out;
+    }
+    int n = rxClosure(r, r->ids, k, 0, 0, r->list);
+    unsigned int flushes = d->flushes;
+    next = rxDfaState(r, d, r->list, n);
+    // 清空过缓存时 s 已经不存在了
+    if (d->flushes == flushes)
+        d->next[s * 256 + c] = next * 256;
+    return next;
+}
+
+void rxDfaInit(struct regexdfa *d, int entry)
+{
+    d->entry = entry;
+    d->states = malloc(sizeof(struct rxstate) * EDITOR_REGEX_STATES);
+    d->next = malloc(sizeof(int) * 256 * EDITOR_REGEX_STATES);
+    d->hashmask = EDITOR_REGEX_STATES * 2 - 1;
+    d->hash = malloc(sizeof(int) * (d->hashmask + 1));
+    if (d->states == NULL || d->next == NULL || d->hash == NULL)
+        die("malloc");
+    d->pool = NULL;
+    d->poolcap = 0;
+    d->flushes = 0;
+    rxDfaFlush(d);
+}
+
+void rxDfaFree(struct regexdfa *d)
+{
+    free(d->states);
+    free(d->next);
+    free(d->hash);
+    free(d->pool);
+}
+
+// 共用 prog 的一份匹配器，惰性 DFA 缓存各自独立，每个线程一份
+struct regex *regexNew(struct regexprog *g)
+{
+    struct regex *r = calloc(1, sizeof(struct regex));
+    if (r == NULL)
+        die("calloc");
+    r->prog = g;
+    r->stack = malloc(sizeof(int) * g->nnodes * 3);
+    r->list = malloc(sizeof(int) * g->nnodes);
+    r->ids = malloc(sizeof(int) * g->nnodes);
+    r->tmp = malloc(sizeof(int) * g->nnodes);
+    r->mark = calloc(g->nnodes, sizeof(unsigned int));
+    if (r->stack == NULL || r->list == NULL || r->ids == NULL || r->tmp == NULL || r->mark == NULL)
+        die("malloc");
+    rxDfaInit(&r->rev, g->rstart);
+    rxDfaInit(&r->fwd, g->astart);
+    return r;
+}
+
+// 释放匹配器，prog 由编译出它的那一份释放
+void regexFree(struct regex *r)
+{
+    if (r == NULL)
+        return;
+    rxDfaFree(&r->rev);
+    rxDfaFree(&r->fwd);
+    free(r->stack);
+    free(r->list);
+    free(r->ids);
+    free(r->tmp);
+    free(r->mark);
+    free(r->starts);
+    if (r->owner)
+    {
+        free(r->prog->nodes);
+        free(r->prog->sets);
+        free(r->prog->lit);
+        free(r->prog);
+    }
+    free(r);
+}
+
+// 编译正则表达式，出错时返回 NULL 并把原因写入 *error
+// 生成两个 NFA：反向读取、前面可以跳过任意字节的，用来找出所有匹配的起点；从起点正向读取的，用来求最长匹配
+struct regex *regexCompile(const char *pattern, int icase, const char **error)
+{
+    struct rxparse P;
+    memset(&P, 0, sizeof(P));
+    P.p = pattern;
+    P.icase = icase;
+    int root = rxParseAlt(&P);
+    if (root >= 0 && *P.p != '\0')
+        P.error = "unmatched )";
+
+    struct regexprog *g = NULL;
+    if (P.error == NULL)
+    {
+        g = malloc(sizeof(struct regexprog));
+        if (g == NULL)
+            die("malloc");
+        g->nodes = malloc(sizeof(struct rxnode) * EDITOR_REGEX_NODES);
+        if (g->nodes == NULL)
+            die("malloc");
+        g->nnodes = 0;
+        g->lit = NULL;
+        struct rxliteral L;
+        L.nbest = L.ncur = 0;
+        rxLiteralWalk(&P, root, &L);
+        if (L.nbest > 0)
+        {
+            g->lit = malloc(L.nbest + 1);
+            if (g->lit == NULL)
+                die("malloc");
+            memcpy(g->lit, L.best, L.nbest);
+            g->lit[L.nbest] = '\0';
+        }
+        g->sets = P.sets;
+        g->nsets = P.nsets;
+        P.sets = NULL;
+        // 任意字节的集合用于反向时跳过匹配结尾之后的部分
+        int any = P.nsets;
+        g->sets = realloc(g->sets, 32 * (any + 1));
+        if (g->sets == NULL)
+            die("realloc");
+        memset(g->sets[any], 0xff, 32);
+        g->nsets = any + 1;
+
+        int match = rxNode(g, RX_MATCH, -1, -1, -1);
+        g->astart = rxEmit(g, P.ast, root, match, 0);
+        int body = rxEmit(g, P.ast, root, match, 1);
+        int loop = body < 0 ? -1 : rxNode(g, RX_SPLIT, -1, -1, body);
+        int skip = loop < 0 ? -1 : rxNode(g, RX_SET, any, loop, -1);
+        if (skip < 0 || g->astart < 0)
+        {
+            P.error = "pattern too large";
+        }
+        else
+        {
+            g->nodes[loop].out = skip;
+            g->rstart = loop;
+        }
+    }
+    free(P.ast);
+    free(P.sets);
+    if (P.error)
+    {
+        if (g)
+        {
+            free(g->nodes);
+            free(g->sets);
+            free(g->lit);
+            free(g);
+        }
+        *error = P.error;
+        return NULL;
+    }
+
+    struct regex *r = regexNew(g);
+    r->owner = 1;
+    // 可以匹配空串的表达式在每个位置都有匹配，查找时没有意义
+    int n = rxClosure(r, &g->astart, 1, 1, 1, r->list);
+    if (rxHasMatch(g, r->list, n))
+    {
+        regexFree(r);
+        *error = "matches empty string";
+        return NULL;
+    }
+    return r;
+}
+
+// 从行尾向前扫描 text[0, n)，把在 [lo, hi) 中开始的匹配的起点按从大到小写入 r->starts
+// 最多找 max 个，返回个数；每个字节只经过一次 DFA 转移
+size_t regexStarts(struct regex *r, const char *text, size_t n, size_t lo, size_t hi, size_t max)
+{
+    struct regexdfa *d = &r->rev;
+    int s = rxDfaStart(r, d, 1) * 256; // 乘以 256 后直接是 next 中的下标
+    size_t k = 0;
+    size_t i = n;
+    while (i > lo && k < max)
+    {
+        i--;
+        unsigned char c = text[i];
+        int next = d->next[s + c];
+        s = next >= 0 ? next : rxDfaStep(r, d, s >> 8, c) * 256;
+        const struct rxstate *st = &d->states[s >> 8];
+        if (i < hi && (st->accept || (i == 0 && st->endaccept)))
+        {
+            if (k == r->startcap)
+            {
+                r->startcap = r->startcap ? r->startcap * 2 : 64;
+                r->starts = realloc(r->starts, sizeof(size_t) * r->startcap);
+                if (r->starts == NULL)
+                    die("realloc");
+            }
+            r->starts[k++] = i;
+        }
+    }
+    return k;
+}
+
+// 从 s 开始的最长匹配的长度，没有匹配时返回 0
+size_t regexMatchLen(struct regex *r, const char *text, size_t n, size_t s)
+{
+    struct regexdfa *d = &r->fwd;
+    int st = rxDfaStart(r, d, s == 0);
+    size_t len = 0;
+    size_t i;
+    for (i = s; i < n; i++)
+    {
+        unsigned char c = text[i];
+        int next = d->next[st * 256 + c];
+        st = next >= 0 ? next >> 8 : rxDfaStep(r, d, st, c);
+        if (d->states[st].n == 0)
+            return len;
+        if (d->states[st].accept)
+            len = i + 1 - s;
+    }
+    if (d->states[st].endaccept)
+        len = n - s;
+    return len;
+}
+
+/*** find ***/
+
+// 单词中的字节：字母、数字、下划线和非 ASCII 字节
+int searchWordChar(unsigned char c)
+{
+    return isalnum(c) || c == '_' || c >= 0x80;
+}
+
+unsigned char searchFold(unsigned char c)
+{
+    return c >= 'A' && c <= 'Z' ? c | 0x20 : c;
+}
+
+void searchFree(struct searchquery *q)
+{
+    free(q->s);
+    regexFree(q->re);
+    if (q->must)
+    {
+        searchFree(q->must);
+        free(q->must);
+    }
+    memset(q, 0, sizeof(*q));
+}
+
+// 编译查询，q 中原有的内容会被释放；正则表达式有错时返回 -1，原因在 q->error
+int searchCompile(struct searchquery *q, const char *s, int icase, int word, int regex)
+{
+    size_t len = strlen(s);
+    searchFree(q);
+    q->s = malloc(len + 1);
+    if (q->s == NULL)
+        die("malloc");
+    size_t i;
+    // 正则表达式保留原文，忽略大小写由字节集合处理
+    for (i = 0; i < len; i++)
+        q->s[i] = icase && !regex ? searchFold(s[i]) : s[i];
+    q->s[len] = '\0';
+    q->len = len;
+    q->icase = icase;
+    q->word = word;
+    q->regex = regex;
+    if (len == 0)
+        return 0;
+    if (regex)
+    {
+        q->re = regexCompile(s, icase, &q->error);
+        if (q->re == NULL)
+            return -1;
+        if (q->re->prog->lit)
+        {
+            q->must = calloc(1, sizeof(struct searchquery));
+            if (q->must == NULL)
+                die("calloc");
+            searchCompile(q->must, q->re->prog->lit, icase, 0, 0);
+        }
+        return 0;
+    }
+    q->first = q->s[0];
+    q->last = q->s[len - 1];
+    // 小写字母或上 0x20 后和大写字母相同，其他字节 0x20 这一位可能不同，只能精确比较
+    q->firstfold = icase && q->first >= 'a' && q->first <= 'z' ? 0x20 : 0;
+    q->lastfold = icase && q->last >= 'a' && q->last <= 'z' ? 0x20 : 0;
+    q->ntri = editorTrigramKeys(q->s, len, q->tri);
+    return 0;
+}
+
+// 是否有可以查找的查询
+int searchReady(const struct searchquery *q)
+{
+    return q->len > 0 && (!q->regex || q->re);
+}
+
+// 新的查询是否以 q 开头：这时新查询的每个匹配也是 q 的匹配，正则表达式不一定
+int searchExtends(const struct searchquery *q, const char *s, int icase, int word, int regex)
+{
+    if (q->s == NULL || q->len == 0 || q->icase != icase || q->word != word || q->regex || regex)
+        return 0;
+    size_t i;
+    for (i = 0; i < q->len; i++)
+        if ((icase ? searchFold(s[i]) : (unsigned char)s[i]) != (unsigned char)q->s[i])
+            return 0;
+    return 1;
+}
+
+// text 中 [j, j + len) 前后是否都不是单词中的字节
+int searchWordBounds(const char *text, size_t n, size_t j, size_t len)
+{
+    if (j > 0 && searchWordChar(text[j - 1]))
+        return 0;
+    if (j + len < n && searchWordChar(text[j + len]))
+        return 0;
+    return 1;
+}
+
+// 首尾字节已经相符，检查 text 中从 j 开始的匹配是否成立，调用者保证 j + q->len <= n
+int searchVerify(const struct searchquery *q, const char *text, size_t n, size_t j)
+{
+    if (q->icase)
+    {
+        size_t k;
+        for (k = 1; k + 1 < q->len; k++)
+            if (searchFold(text[j + k]) != (unsigned char)q->s[k])
+                return 0;
+    }
+    else if (q->len > 2 && memcmp(text + j + 1, q->s + 1, q->len - 2) != 0)
+    {
+        return 0;
+    }
+    return !q->word || searchWordBounds(text, n, j, q->len);
+}
+
+// 正则表达式在 text[0, n) 中匹配的长度，整词匹配时要求最长匹配前后是单词边界
+size_t searchRegexLen(const struct searchquery *q, const char *text, size_t n, size_t j)
+{
+    size_t len = regexMatchLen(q->re, text, n, j);
+    if (q->word && !searchWordBounds(text, n, j, len))
+        return 0;
+    return len;
+}
+
+int searchCandidate(const struct searchquery *q, const char *text, size_t j)
+{
+    return ((unsigned char)text[j] | q->firstfold) == q->first &&
+           ((unsigned char)text[j + q->len - 1] | q->lastfold) == q->last;
+}
+
+// 在起点 [lo, hi) 中查找第一个匹配，调用者保证 hi + q->len - 1 <= n，没有时返回 SIZE_MAX
+size_t searchScanScalar(const struct searchquery *q, const char *text, size_t n, size_t lo, size_t hi)
+{
+    size_t j;
+    for (j = lo; j < hi; j++)
+        if (searchCandidate(q, text, j) && searchVerify(q, text, n, j))
+            return j;
+    return SIZE_MAX;
+}
+
+// 在起点 [lo, hi) 中查找最后一个匹配
+size_t searchScanBackScalar(const struct searchquery *q, const char *text, size_t n, size_t lo, size_t hi)
+{
+    size_t j;
+    for (j = hi; j > lo; j--)
+        if (searchCandidate(q, text, j - 1) && searchVerify(q, text, n, j - 1))
+            return j - 1;
+    return SIZE_MAX;
+}
+
+// 向量版本：每次比较连续 16/32 个起点的首字节和对应的末字节，两者都相符的才逐个验证
+#ifdef __SSE2__
+size_t searchScanSSE2(const struct searchquery *q, const char *text, size_t n, size_t lo, size_t hi)
+{
+    const __m128i first = _mm_set1_epi8(q->first), last = _mm_set1_epi8(q->last);
+    const __m128i ff = _mm_set1_epi8(q->firstfold), lf = _mm_set1_epi8(q->lastfold);
+    const char *tail = text + q->len - 1;
+    size_t j;
+    for (j = lo; j + 16 <= hi; j += 16)
+    {
+        __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i *)(text + j)), ff);
+        __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i *)(tail + j)), lf);
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask)
+        {
+            size_t k = j + __builtin_ctz(mask);
+            if (searchVerify(q, text, n, k))
+                return k;
+            mask &= mask - 1;
+        }
+    }
+    return searchScanScalar(q, text, n, j, hi);
+}
+
+size_t searchScanBackSSE2(const struct searchquery *q, const char *text, size_t n, size_t lo, size_t hi)
+{
+    const __m128i first = _mm_set1_epi8(q->first), last = _mm_set1_epi8(q->last);
+    const __m128i ff = _mm_set1_epi8(q->firstfold), lf = _mm_set1_epi8(q->lastfold);
+    const char *tail = text + q->len - 1;
+    size_t j;
+    for (j = hi; j >= lo + 16; j -= 16)
+    {
+        __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i *)(text + j - 16)), ff);
+        __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i *)(tail + j - 16)), lf);
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask)
+        {
+            int bit = 31 - __builtin_clz(mask);
+            if (searchVerify(q, text, n, j - 16 + bit))
+                return j - 16 + bit;
+            mask &= ~(1u << bit);
+        }
+    }
+    return searchScanBackScalar(q, text, n, lo, j);
+}
+#endif
+
+#ifdef KILO_AVX2
+__attribute__((target("avx2"))) size_t searchScanAVX2(const struct searchquery *q, const char *text, size_t n, size_t lo, size_t hi)
+{
+    const __m256i first = _mm256_set1_epi8(q->first), last = _mm256_set1_epi8(q->last);
+    const __m256i ff = _mm256_set1_epi8(q->firstfold), lf = _mm256_set1_epi8(q->lastfold);
+    const char *tail = text + q->len - 1;
+    size_t j;
+    for (j = lo; j + 32 <= hi; j += 32)
+    {
+        __m256i a = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(text + j)), ff);
+        __m256i b = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(tail + j)), lf);
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        while (mask)
+        {
+            size_t k = j + __builtin_ctz(mask);
+            if (searchVerify(q, text, n, k))
+                return k;
+            mask &= mask - 1;
+        }
+    }
+    return searchScanScalar(q, text, n, j, hi);
+}
+
+__attribute__((target("avx2"))) size_t searchScanBackAVX2(const struct searchquery *q, const char *text, size_t n, size_t lo, size_t hi)
+{
+    const __m256i first = _mm256_set1_epi8(q->first), last = _mm256_set1_epi8(q->last);
+    const __m256i ff = _mm256_set1_epi8(q->firstfold), lf = _mm256_set1_epi8(q->lastfold);
+    const char *tail = text + q->len - 1;
+    size_t j;
+    for (j = hi; j >= lo + 32; j -= 32)
+    {
+        __m256i a = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(text + j - 32)), ff);
+        __m256i b = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(tail + j - 32)), lf);
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        while (mask)
+        {
+            int bit = 31 - __builtin_clz(mask);
+            if (searchVerify(q, text, n, j - 32 + bit))
+                return j - 32 + bit;
+            mask &= ~(1u << bit);
+        }
+    }
+    return searchScanBackScalar(q, text, n, lo, j);
+}
+#endif
+
+// 在 [lo, hi) 中查找起点，调用者保证 hi + q->len - 1 <= n
+size_t searchRange(const struct searchquery *q, const char *text, size_t n, size_t lo, size_t hi)
+{
+#ifdef KILO_AVX2
+    if (cpuHasAVX2())
+        return searchScanAVX2(q, text, n, lo, hi);
+#endif
+#ifdef __SSE2__
+    return searchScanSSE2(q, text, n, lo, hi);
+#else
+    return searchScanScalar(q, text, n, lo, hi);
+#endif
+}
+
+// 在 [lo, hi) 中查找最后一个起点
+size_t searchRangeBack(const struct searchquery *q, const char *text, size_t n, size_t lo, size_t hi)
+{
+#ifdef KILO_AVX2
+    if (cpuHasAVX2())
+        return searchScanBackAVX2(q, text, n, lo, hi);
+#endif
+#ifdef __SSE2__
+    return searchScanBackSSE2(q, text, n, lo, hi);
+#else
+    return searchScanBackScalar(q, text, n, lo, hi);
+#endif
+}
+
+// 三元组索引已经建好，并且 text 在建立索引的映射中
+int searchIndexUsable(const struct searchquery *q, const char *text, size_t n)
+{
+    const struct editorTrigram *T = &E.trigram;
+    return T->ready && q->ntri > 0 && (uintptr_t)text >= (uintptr_t)T->map &&
+           (uintptr_t)text + n <= (uintptr_t)T->map + T->len;
+}
+
+// 和 searchRange() 相同，但跳过索引中不含全部三元组的块
+size_t searchIndexed(const struct searchquery *q, const char *text, size_t n, size_t lo, size_t hi)
+{
+    if (!searchIndexUsable(q, text, n))
+        return searchRange(q, text, n, lo, hi);
+    size_t base = text - E.trigram.map;
+    while (lo < hi)
+    {
+        size_t b = (base + lo) / EDITOR_TRIGRAM_BLOCK;
+        size_t end = (b + 1) * EDITOR_TRIGRAM_BLOCK - base;
+        if (end > hi)
+            end = hi;
+        if (editorTrigramMaybe(q->tri, q->ntri, b))
+        {
+            size_t j = searchRange(q, text, n, lo, end);
+            if (j != SIZE_MAX)
+                return j;
+        }
+        lo = end;
+    }
+    return SIZE_MAX;
+}
+
+size_t searchIndexedBack(const struct searchquery *q, const char *text, size_t n, size_t lo, size_t hi)
+{
+    if (!searchIndexUsable(q, text, n))
+        return searchRangeBack(q, text, n, lo, hi);
+    size_t base = text - E.trigram.map;
+    while (lo < hi)
+    {
+        size_t b = (base + hi - 1) / EDITOR_TRIGRAM_BLOCK;
+        size_t start = b * EDITOR_TRIGRAM_BLOCK > base + lo ? b * EDITOR_TRIGRAM_BLOCK - base : lo;
+        if (editorTrigramMaybe(q->tri, q->ntri, b))
+        {
+            size_t j = searchRangeBack(q, text, n, start, hi);
+            if (j != SIZE_MAX)
+                return j;
+        }
+        hi = start;
+    }
+    return SIZE_MAX;
+}
+
+// 在 text[0, n) 中查找从 from 或之后开始的第一个匹配，没有时返回 SIZE_MAX
+size_t searchForward(const struct searchquery *q, const char *text, size_t n, size_t from)
+{
+    if (q->regex)
+    {
+        // 匹配中的字面串也在 from 之后
+        if (q->must && searchForward(q->must, text, n, from) == SIZE_MAX)
+            return SIZE_MAX;
+        // 反向扫描到 from 才能知道最小的起点，找出的起点从小到大检查
+        size_t k = regexStarts(q->re, text, n, from, n, SIZE_MAX);
+        while (k-- > 0)
+            if (!q->word || searchRegexLen(q, text, n, q->re->starts[k]) > 0)
+                return q->re->starts[k];
+        return SIZE_MAX;
+    }
+    if (q->len == 0 || n < q->len || from > n - q->len)
+        return SIZE_MAX;
+    return searchIndexed(q, text, n, from, n - q->len + 1);
+}
+
+// 在 text[0, n) 中查找在 before 之前开始的最后一个匹配
+size_t searchBackward(const struct searchquery *q, const char *text, size_t n, size_t before)
+{
+    if (q->regex)
+    {
+        if (q->must && searchForward(q->must, text, n, 0) == SIZE_MAX)
+            return SIZE_MAX;
+        // 反向扫描先遇到的就是最后一个起点
+        size_t k = regexStarts(q->re, text, n, 0, before < n ? before : n, q->word ? SIZE_MAX : 1);
+        size_t i;
+        for (i = 0; i < k; i++)
+            if (!q->word || searchRegexLen(q, text, n, q->re->starts[i]) > 0)
+                return q->re->starts[i];
+        return SIZE_MAX;
+    }
+    if (q->len == 0 || n < q->len)
+        return SIZE_MAX;
+    size_t hi = n - q->len + 1;
+    if (before < hi)
+        hi = before;
+    return searchIndexedBack(q, text, n, 0, hi);
+}
+
+// flat 子树在映射中是一整块，匹配在块中的偏移 j 换算成行号和列
+void searchBlockHit(const char *block, size_t base, size_t j, size_t *y, size_t *x)
+{
+    const char *nl = memrchr(block, '\n', j);
+    *y = base + countNewlines(block, j);
+    *x = nl ? (size_t)(block + j - nl - 1) : j;
+}
+
+// 整块中偏移 j 所在的一行：返回行首的偏移，行的长度（和行一样去掉行尾的回车）写入 *len，下一行的行首写入 *next
+size_t searchBlockLine(const char *block, size_t n, size_t j, size_t *len, size_t *next)
+{
+    const char *nl = memrchr(block, '\n', j);
+    size_t start = nl ? (size_t)(nl + 1 - block) : 0;
+    const char *end = memchr(block + j, '\n', n - j);
+    size_t stop = end ? (size_t)(end - block) : n;
+    *next = end ? stop + 1 : n;
+    while (stop > start && block[stop - 1] == '\r')
+        stop--;
+    *len = stop - start;
+    return start;
+}
+
+// 正则表达式在整块中从 from 开始的第一个匹配：先用字面串找出可能有匹配的行，只在这些行中运行 DFA
+size_t searchBlockRegex(const struct searchquery *q, const char *block, size_t n, size_t from)
+{
+    size_t j;
+    while ((j = searchForward(q->must, block, n, from)) != SIZE_MAX)
+    {
+        size_t len, next, start = searchBlockLine(block, n, j, &len, &next);
+        size_t k = searchForward(q, block + start, len, from > start ? from - start : 0);
+        if (k != SIZE_MAX)
+            return start + k;
+        from = next;
+    }
+    return SIZE_MAX;
+}
+
+// 整块中在 before 之前开始的最后一个匹配，字面串可能在 before 之后，但和起点在同一行
+size_t searchBlockRegexBack(const struct searchquery *q, const char *block, size_t n, size_t before)
+{
+    const char *nl = before < n ? memchr(block + before, '\n', n - before) : NULL;
+    size_t end = nl ? (size_t)(nl - block) : n;
+    size_t j;
+    while (end > 0 && (j = searchBackward(q->must, block, n, end)) != SIZE_MAX)
+    {
+        size_t len, next, start = searchBlockLine(block, n, j, &len, &next);
+        size_t k = searchBackward(q, block + start, len, before - start);
+        if (k != SIZE_MAX)
+            return start + k;
+        end = start;
+    }
+    return SIZE_MAX;
+}
 
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    E.row[at].hl = NULL;
-    E.row[at].hl_open_comment = 0;
-    editorUpdateRow(&E.row[at]);
+// 在子树 t（第一行行号为 base）中查找第 [lo, hi) 行中的第一个匹配，第 lo 行从第 col 列开始
+// flat 子树直接在映射中整块扫描，不逐行处理；正则表达式要有字面串才能整块查找
+int searchTree(const struct searchquery *q, rownode *t, size_t base, size_t lo, size_t hi, size_t col,
+               size_t *y, size_t *x)
+{
+    if (t == NULL || base >= hi || base + t->count <= lo)
+        return 0;
+    if ((!q->regex || q->must) && t->flat && lo <= base && base + t->count <= hi && rowFlat(t))
+    {
+        erow *first = &rowFirst(t)->row, *last = &rowLast(t)->row;
+        size_t n = last->chars + last->size - first->chars;
+        size_t from = lo < base ? 0 : col < first->size ? col : first->size;
+        size_t j = q->regex ? searchBlockRegex(q, first->chars, n, from) : searchForward(q, first->chars, n, from);
+        E.findbytes += (j == SIZE_MAX ? n : j) - from;
+        if (j == SIZE_MAX)
+            return 0;
+        searchBlockHit(first->chars, base, j, y, x);
+        return 1;
+    }
 
-    E.numrows++; // 表示行数 +1
-    E.dirty++;   // 脏位
+    if (searchTree(q, t->left, base, lo, hi, col, y, x))
+        return 1;
+    size_t at = base + rowCount(t->left);
+    if (at >= lo && at < hi)
+    {
+        erow *row = &t->row;
+        size_t from = at == lo ? col : 0;
+        size_t j = searchForward(q, editorRowLinear(row), row->size, from);
+        E.findbytes += row->size;
+        if (j != SIZE_MAX)
+        {
+            *y = at;
+            *x = j;
+            return 1;
+        }
+    }
+    return searchTree(q, t->right, at + 1, lo, hi, col, y, x);
 }
 
-void editorFreeRow(erow *row)
+// 在第 [lo, hi) 行中查找最后一个匹配，第 hi - 1 行的匹配要在第 col 列之前开始
+int searchTreeBack(const struct searchquery *q, rownode *t, size_t base, size_t lo, size_t hi, size_t col,
+                   size_t *y, size_t *x)
 {
-    free(row->render);
-    free(row->chars);
-    free(row->hl);
+    if (t == NULL || base >= hi || base + t->count <= lo)
+        return 0;
+    if ((!q->regex || q->must) && t->flat && lo <= base && base + t->count <= hi && rowFlat(t))
+    {
+        erow *first = &rowFirst(t)->row, *last = &rowLast(t)->row;
+        size_t n = last->chars + last->size - first->chars;
+        size_t before = n;
+        if (base + t->count == hi && col < last->size)
+            before = last->chars - first->chars + col;
+        size_t j = q->regex ? searchBlockRegexBack(q, first->chars, n, before) : searchBackward(q, first->chars, n, before);
+        E.findbytes += j == SIZE_MAX ? before : before - j;
+        if (j == SIZE_MAX)
+            return 0;
+        searchBlockHit(first->chars, base, j, y, x);
+        return 1;
+    }
+
+    size_t at = base + rowCount(t->left);
+    if (searchTreeBack(q, t->right, at + 1, lo, hi, col, y, x))
+        return 1;
+    if (at >= lo && at < hi)
+    {
+        erow *row = &t->row;
+        size_t j = searchBackward(q, editorRowLinear(row), row->size, at == hi - 1 ? col : SIZE_MAX);
+        E.findbytes += row->size;
+        if (j != SIZE_MAX)
+        {
+            *y = at;
+            *x = j;
+            return 1;
+        }
+    }
+    return searchTreeBack(q, t->left, base, lo, hi, col, y, x);
 }
 
-void editorDelRow(int at)
+// 查找第 *cy 行第 *cx 列或之后的第一个匹配，到文件末尾后从头继续
+// 找到时把位置写回 *cy、*cx 并返回 1
+int editorFindNext(const struct searchquery *q, size_t *cy, size_t *cx)
 {
-    // 检查位置合法性
-    if (at < 0 || at >= E.numrows)
-        return;
-    editorFreeRow(&E.row[at]);
-    // 将后面所有行向前移动
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-    for (int j = at; j < E.numrows - 1; j++)
-        E.row[j].idx--;
-    E.numrows--;
-    E.dirty++;
+    editorLoadUntil(SIZE_MAX);
+    if (!searchReady(q) || E.numrows == 0)
+        return 0;
+    double start = editorNow();
+    size_t y = *cy, x = *cx;
+    if (y >= E.numrows)
+        y = x = 0;
+    int found = searchTree(q, E.rowroot, 0, y, E.numrows, x, cy, cx) ||
+                searchTree(q, E.rowroot, 0, 0, y + 1, 0, cy, cx);
+    E.findtime += editorNow() - start;
+    return found;
 }
 
-void editorRowInsertChar(erow *row, int at, int c)
+// 查找在第 *cy 行第 *cx 列之前开始的最后一个匹配，到文件开头后从末尾继续
+int editorFindPrev(const struct searchquery *q, size_t *cy, size_t *cx)
 {
-    // 检查字符位置是否合规
-    if (at < 0 || at > row->size)
-        at = row->size;
-    row->chars = realloc(row->chars, row->size + 2); // 字符 + null
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    row->size++;
-    row->chars[at] = c;
-    editorUpdateRow(row);
+    editorLoadUntil(SIZE_MAX);
+    if (!searchReady(q) || E.numrows == 0)
+        return 0;
+    double start = editorNow();
+    size_t y = *cy, x = *cx;
+    if (y >= E.numrows)
+    {
+        y = E.numrows - 1;
+        x = SIZE_MAX;
+    }
+    int found = searchTreeBack(q, E.rowroot, 0, 0, y + 1, x, cy, cx) ||
+                searchTreeBack(q, E.rowroot, 0, y, E.numrows, SIZE_MAX, cy, cx);
+    E.findtime += editorNow() - start;
+    return found;
+}
 
-    E.dirty++;
+// 第一个不在第 y 行第 x 列之前的匹配的下标
+size_t searchLowerBound(const struct searchmatch *m, size_t n, size_t y, size_t x)
+{
+    size_t lo = 0, hi = n;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (m[mid].y < y || (m[mid].y == y && m[mid].x < x))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len)
+// 按行号顺序收集匹配，攒够一批或者扫描够一段时交给 flush
+// 后台查找把匹配交给主线程，全部替换把匹配保存下来
+struct searchcollect
 {
-    // +1 是包括空字节
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-    E.dirty++;
+    struct searchquery q; // 查询的副本，正则表达式有自己的 DFA 缓存
+    struct searchmatch batch[EDITOR_FIND_BATCH];
+    size_t nbatch;
+    size_t scanned; // 上次提交之后扫描的字节数
+    size_t bytes;   // 扫描的总字节数
+    int (*flush)(struct searchcollect *c); // 取走 batch 中的匹配，返回 0 表示停止查找
+    void *sink;                            // flush 使用的数据
+};
+
+void searchCollectInit(struct searchcollect *c, const struct searchquery *q,
+                       int (*flush)(struct searchcollect *c), void *sink)
+{
+    c->q = *q;
+    c->nbatch = 0;
+    c->scanned = 0;
+    c->bytes = 0;
+    c->flush = flush;
+    c->sink = sink;
 }
 
-void editorRowDelChar(erow *row, int at)
+int searchFlush(struct searchcollect *c)
 {
-    // 检查字符位置是否合规
-    if (at < 0 || at >= row->size)
-        return;
-    // 删除字符：移动后面的所有字符
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
-    editorUpdateRow(row);
-    E.dirty++;
+    int more = c->flush(c);
+    c->nbatch = 0;
+    c->scanned = 0;
+    return more;
 }
 
-/*** editor operations ***/
+int searchAdd(struct searchcollect *c, size_t y, size_t x)
+{
+    c->batch[c->nbatch].y = y;
+    c->batch[c->nbatch].x = x;
+    if (++c->nbatch == EDITOR_FIND_BATCH)
+        return searchFlush(c);
+    return 1;
+}
 
-void editorInsertChar(int c)
+// 每扫描 EDITOR_FIND_PIECE 字节提交一次，顺便检查是否已经取消
+int searchProgress(struct searchcollect *c, size_t bytes)
 {
-    // 如果光标位于文件末尾的波浪线上，需要插入字符前添加一个新行
-    if (E.cy == E.numrows)
+    c->bytes += bytes;
+    c->scanned += bytes;
+    if (c->scanned >= EDITOR_FIND_PIECE)
+        return searchFlush(c);
+    return 1;
+}
+
+// 找出 flat 子树对应的整块内存中的所有匹配，第一行的行号为 base
+int searchCollectBlock(struct searchcollect *c, const char *block, size_t n, size_t base)
+{
+    const struct searchquery *q = &c->q;
+    if (n < q->len)
+        return 1;
+    size_t end = n - q->len + 1;
+    size_t y = base;
+    const char *line = block;    // 第 y 行的开头
+    const char *counted = block; // 换行符已经数到这里
+    size_t lo = 0;
+    while (lo < end)
     {
-        editorInsertRow(E.numrows, "", 0);
+        size_t piece = lo;
+        size_t hi = end - lo > EDITOR_FIND_PIECE ? lo + EDITOR_FIND_PIECE : end;
+        size_t j;
+        while ((j = searchIndexed(q, block, n, lo, hi)) != SIZE_MAX)
+        {
+            const char *p = block + j;
+            const char *nl = memrchr(counted, '\n', p - counted);
+            if (nl)
+            {
+                y += countNewlines(counted, nl + 1 - counted);
+                line = nl + 1;
+            }
+            counted = p;
+            if (!searchAdd(c, y, p - line))
+                return 0;
+            lo = j + 1;
+        }
+        if (!searchProgress(c, hi - piece))
+            return 0;
+        lo = hi;
     }
-    editorRowInsertChar(&E.row[E.cy], E.cx, c);
-    E.cx++;
+    return 1;
 }
 
-void editorInsertNewline()
+// 找出第 y 行中的所有匹配
+int searchCollectRow(struct searchcollect *c, const char *text, size_t n, size_t y)
 {
-    // 如果在第一行开头，在所在行之前插入空白行
-    if (E.cx == 0)
+    const struct searchquery *q = &c->q;
+    if (q->regex)
     {
-        editorInsertRow(E.cy, "", 0);
+        size_t k = q->must && searchForward(q->must, text, n, 0) == SIZE_MAX ? 0 : regexStarts(q->re, text, n, 0, n, SIZE_MAX);
+        while (k-- > 0)
+            if ((!q->word || searchRegexLen(q, text, n, q->re->starts[k]) > 0) &&
+                !searchAdd(c, y, q->re->starts[k]))
+                return 0;
     }
     else
     {
-        erow *row = &E.row[E.cy];
-        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-        row = &E.row[E.cy];
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        editorUpdateRow(row);
+        size_t j = 0;
+        while ((j = searchForward(q, text, n, j)) != SIZE_MAX)
+        {
+            if (!searchAdd(c, y, j))
+                return 0;
+            j++;
+        }
     }
-    // 移动光标到行开头
-    E.cy++;
-    E.cx = 0;
+    return searchProgress(c, n);
 }
 
-void editorDelChar()
+// 正则表达式的整块查找：先用字面串找出可能有匹配的行，再逐行交给 searchCollectRow()
+int searchCollectRegexBlock(struct searchcollect *c, const char *block, size_t n, size_t base)
 {
-    // 如果光标超过文件内容，无需删除操作
-    if (E.cy == E.numrows)
-        return;
-    // 光标位于文件开头，不响应删除
-    if (E.cx == 0 && E.cy == 0)
-        return;
-
-    erow *row = &E.row[E.cy];
-
-    if (E.cx > 0)
+    const struct searchquery *m = c->q.must;
+    if (n < m->len)
+        return 1;
+    size_t end = n - m->len + 1;
+    size_t y = base, counted = 0, lo = 0;
+    while (lo < end)
     {
-        // Backspace 删除光标左侧字符
-        editorRowDelChar(row, E.cx - 1);
-        E.cx--;
+        size_t hi = end - lo > EDITOR_FIND_PIECE ? lo + EDITOR_FIND_PIECE : end;
+        size_t j = searchIndexed(m, block, n, lo, hi);
+        if (j == SIZE_MAX)
+        {
+            if (!searchProgress(c, hi - lo))
+                return 0;
+            lo = hi;
+            continue;
+        }
+        size_t len, next, start = searchBlockLine(block, n, j, &len, &next);
+        y += countNewlines(block + counted, start - counted);
+        counted = start;
+        if (!searchCollectRow(c, block + start, len, y))
+            return 0;
+        if (next > lo + len && !searchProgress(c, next - lo - len))
+            return 0;
+        lo = next;
     }
-    else
+    return 1;
+}
+
+// 按行号顺序找出子树中的所有匹配，返回 0 表示已经取消
+int searchCollectTree(struct searchcollect *c, rownode *t, size_t base)
+{
+    if (t == NULL)
+        return 1;
+    // 没有字面串的正则表达式只能逐行匹配
+    if ((!c->q.regex || c->q.must) && rowFlat(t))
     {
-        // 光标定位到上一行末尾
-        E.cx = E.row[E.cy - 1].size;
-        // 当前行拼接到上一行结尾
-        editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-        // 删除当前行
-        editorDelRow(E.cy);
-        E.cy--;
+        erow *first = &rowFirst(t)->row, *last = &rowLast(t)->row;
+        size_t n = last->chars + last->size - first->chars;
+        return c->q.regex ? searchCollectRegexBlock(c, first->chars, n, base) : searchCollectBlock(c, first->chars, n, base);
     }
+    if (!searchCollectTree(c, t->left, base))
+        return 0;
+    size_t at = base + rowCount(t->left);
+    if (!searchCollectRow(c, t->row.chars, t->row.size, at))
+        return 0;
+    return searchCollectTree(c, t->right, at + 1);
 }
 
-/*** file i/o ***/
-
-char *editorRowsToString(int *buflen)
+// 把攒下的匹配交给主线程，返回 0 表示已经取消
+int editorFindFlush(struct searchcollect *c)
 {
-    // 写入到磁盘中的字符串需要每行加上一个换行符，计算所需内存
-    int totlen = 0;
-    int j;
-    for (j = 0; j < E.numrows; j++)
-        totlen += E.row[j].size + 1;
-    *buflen = totlen;
-
-    // 分配内存
-    char *buf = malloc(totlen);
-    char *p = buf;
-    for (j = 0; j < E.numrows; j++)
+    struct editorSearch *S = c->sink;
+    pthread_mutex_lock(&S->lock);
+    size_t keep = EDITOR_FIND_MAX_MATCHES - S->nmatches;
+    if (keep > c->nbatch)
+        keep = c->nbatch;
+    if (S->nmatches + keep > S->matchcap)
     {
-        // 复制字符串并在行尾加上换行符
-        memcpy(p, E.row[j].chars, E.row[j].size);
-        p += E.row[j].size;
-        *p = '\n';
-        p++;
+        size_t cap = S->matchcap ? S->matchcap * 2 : EDITOR_FIND_BATCH;
+        while (cap < S->nmatches + keep)
+            cap *= 2;
+        S->matches = realloc(S->matches, sizeof(struct searchmatch) * cap);
+        if (S->matches == NULL)
+            die("realloc");
+        S->matchcap = cap;
     }
+    if (keep > 0)
+        memcpy(&S->matches[S->nmatches], c->batch, sizeof(struct searchmatch) * keep);
+    S->nmatches += keep;
+    S->total += c->nbatch;
+    int cancel = S->cancel;
+    pthread_mutex_unlock(&S->lock);
+    return !cancel;
+}
 
-    return buf;
+void *editorFindThread(void *arg)
+{
+    struct editorSearch *S = arg;
+    struct searchcollect *c = malloc(sizeof(struct searchcollect));
+    if (c == NULL)
+        die("malloc");
+    searchCollectInit(c, &S->q, editorFindFlush, S);
+    if (c->q.regex)
+        c->q.re = regexNew(S->q.re->prog);
+    double start = editorNow();
+    if (searchCollectTree(c, E.rowroot, 0))
+        searchFlush(c);
+    S->time = editorNow() - start;
+    S->bytes = c->bytes;
+    regexFree(c->q.re);
+    free(c);
+
+    pthread_mutex_lock(&S->lock);
+    S->done = 1;
+    pthread_mutex_unlock(&S->lock);
+    return NULL;
 }
 
-void editorOpen(char *filename)
+// 查找线程只读取行：确认它会经过的节点的 flat 标记，并把自己持有的行的间隙移到行尾
+void editorFindPrepare(rownode *t)
 {
-    free(E.filename);
-    // strdup 自动分配内存并复制字符串
-    E.filename = strdup(filename);
+    if (t == NULL || ((!E.search.q.regex || E.search.q.must) && rowFlat(t)))
+        return;
+    editorFindPrepare(t->left);
+    if (!t->row.mapped)
+        editorRowLinear(&t->row);
+    editorFindPrepare(t->right);
+}
 
-    editorSelectSyntaxHighlight();
+void editorFindStart()
+{
+    struct editorSearch *S = &E.search;
+    editorFindPrepare(E.rowroot);
+    S->nmatches = 0;
+    S->total = 0;
+    S->done = 0;
+    S->cancel = 0;
+    S->shown = SIZE_MAX;
+    S->bytes = 0;
+    S->time = 0;
+    S->threaded = pthread_create(&S->thread, NULL, editorFindThread, S) == 0;
+    // 无法创建线程时在主线程中查找完，结果和线程找到的一样交给 editorFindPoll 处理
+    if (!S->threaded)
+        editorFindThread(S);
+    S->active = 1;
+}
 
-    FILE *fp = fopen(filename, "r");
-    if (!fp)
-        die("fopen");
+// 取消并回收查找线程，已经找到的匹配保留到下次开始
+void editorFindStop()
+{
+    struct editorSearch *S = &E.search;
+    if (!S->active)
+        return;
+    pthread_mutex_lock(&S->lock);
+    S->cancel = 1;
+    pthread_mutex_unlock(&S->lock);
+    if (S->threaded)
+        pthread_join(S->thread, NULL);
+    S->active = 0;
+    E.findbytes += S->bytes;
+    E.findtime += S->time;
+}
 
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    // 循环读入行，getline 到达文件末尾时返回 -1
-    // getline 自动为 line 分配内存，分配大小写入 linecap，是行的长度
-    while ((linelen = getline(&line, &linecap, fp)) != -1)
+// 把 n 写成每三位一个逗号的形式
+void editorFormatCount(char *buf, size_t size, size_t n)
+{
+    char digits[32];
+    int len = snprintf(digits, sizeof(digits), "%zu", n);
+    size_t k = 0;
+    int i;
+    for (i = 0; i < len && k + 2 < size; i++)
     {
-        // 去掉换行回车，因为编辑器每行都表示一行文本
-        while (linelen > 0 && (line[linelen - 1] == '\n' ||
-                               line[linelen - 1] == '\r'))
-            linelen--;
-
-        editorInsertRow(E.numrows, line, linelen);
+        if (i > 0 && (len - i) % 3 == 0)
+            buf[k++] = ',';
+        buf[k++] = digits[i];
     }
-    free(line);
-    fclose(fp);
-
-    // 由于打开文件时会调用 editorInsertRow() 修改了脏位，需要重置
-    E.dirty = 0;
+    buf[k] = '\0';
 }
 
-void editorSave()
+// 按当前选项和匹配数生成查找提示，其中只有一个 %s
+void editorFindPrompt()
 {
-    if (E.filename == NULL)
+    struct editorSearch *S = &E.search;
+    char count[96] = "";
+    if (S->q.len > 0 && S->q.error)
     {
-        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-        if (E.filename == NULL)
+        snprintf(count, sizeof(count), " (regex: %s)", S->q.error);
+    }
+    else if (S->q.len > 0)
+    {
+        pthread_mutex_lock(&S->lock);
+        size_t total = S->total;
+        int done = S->done;
+        size_t k = SIZE_MAX;
+        if (S->found)
         {
-            editorSetStatusMessage("Save aborted");
-            return;
+            k = searchLowerBound(S->matches, S->nmatches, S->y, S->x);
+            if (k == S->nmatches || S->matches[k].y != S->y || S->matches[k].x != S->x)
+                k = SIZE_MAX;
         }
-        editorSelectSyntaxHighlight();
+        pthread_mutex_unlock(&S->lock);
+
+        char n[32], i[32];
+        editorFormatCount(n, sizeof(n), total);
+        if (done && total == 0)
+            snprintf(count, sizeof(count), " (no matches)");
+        else if (k != SIZE_MAX)
+        {
+            editorFormatCount(i, sizeof(i), k + 1);
+            snprintf(count, sizeof(count), " (match %s of %s%s)", i, n, done ? "" : "+");
+        }
+        else
+            snprintf(count, sizeof(count), " (%s%s matches)", n, done ? "" : "+");
+        S->shown = total;
     }
+    // 状态栏只有 80 字节：计数放在查询之前，按键提示放在最后，查询较长时只截掉提示
+    snprintf(S->prompt, sizeof(S->prompt), "Search%s%s%s%s: %%s  ESC/Arrows/Enter ^T/^W/^E",
+             S->regex ? " [re]" : "", S->icase ? " [i]" : "", S->word ? " [w]" : "", count);
+}
 
-    int len;
-    char *buf = editorRowsToString(&len);
+void editorFindJump(size_t y, size_t x)
+{
+    struct editorSearch *S = &E.search;
+    S->found = 1;
+    S->y = y;
+    S->x = x;
+    E.cy = y;
+    E.cx = x;
+    E.rowoff = E.numrows;
+
+    E.match_row = editorRowAt(y);
+    E.match_start = x;
+    E.match_len = S->q.regex ? regexMatchLen(S->q.re, editorRowLinear(E.match_row), E.match_row->size, x)
+                             : S->q.len;
+}
 
-    // 以读写模式打开，不存的则创建
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-    // 错误检查
-    if (fd != -1)
+// 找出 text[0, n) 中的所有匹配：字面串的重叠匹配合并成一段，正则表达式跳过起点在上一个匹配之中的
+void editorMatchScan(struct matchline *ml, const struct searchquery *q, const char *text, size_t n)
+{
+    ml->nspans = 0;
+    size_t k = 0, j = 0, end = 0;
+    if (q->regex)
+        k = q->must && searchForward(q->must, text, n, 0) == SIZE_MAX ? 0 : regexStarts(q->re, text, n, 0, n, SIZE_MAX);
+    while (1)
     {
-        // 将文件大小设为 len
-        if (ftruncate(fd, len) != -1)
+        size_t len;
+        if (q->regex)
+        {
+            // 起点从大到小保存
+            if (k == 0)
+                break;
+            j = q->re->starts[--k];
+            if (j < end || (len = searchRegexLen(q, text, n, j)) == 0)
+                continue;
+        }
+        else
+        {
+            if ((j = searchForward(q, text, n, j)) == SIZE_MAX)
+                break;
+            len = q->len;
+        }
+        if (ml->nspans > 0 && j <= end)
+        {
+            ml->spans[ml->nspans - 1].len = j + len - ml->spans[ml->nspans - 1].at;
+        }
+        else
         {
-            if (write(fd, buf, len) == len)
+            if (ml->nspans == ml->cap)
             {
-                close(fd);
-                free(buf);
-                E.dirty = 0; // 保存后重置脏位
-                editorSetStatusMessage("%d bytes written to disk", len);
-                return;
+                ml->cap = ml->cap ? ml->cap * 2 : 8;
+                ml->spans = realloc(ml->spans, sizeof(struct matchspan) * ml->cap);
+                if (ml->spans == NULL)
+                    die("realloc");
             }
+            ml->spans[ml->nspans].at = j;
+            ml->spans[ml->nspans].len = len;
+            ml->nspans++;
         }
-        close(fd);
+        end = j + len;
+        j++;
     }
-
-    free(buf);
-    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
 }
 
-/*** find ***/
-
-void editorFindCallback(char *query, int key)
+// 第 at 行中当前查询的所有匹配，没有查询时返回 NULL；同一行在查询变化之前只查找一次
+const struct matchline *editorMatchLine(erow *row, size_t at)
 {
-    static int last_match = -1;
-    static int direction = 1;
+    struct editorSearch *S = &E.search;
+    if (!searchReady(&S->q))
+        return NULL;
+    if (E.matchcache == NULL)
+    {
+        E.matchcache = calloc(EDITOR_MATCH_CACHE, sizeof(struct matchline));
+        if (E.matchcache == NULL)
+            die("calloc");
+    }
+    struct matchline *ml = &E.matchcache[at % EDITOR_MATCH_CACHE];
+    if (ml->row != row || ml->version != S->version)
+    {
+        editorMatchScan(ml, &S->q, row->render, row->rsize);
+        ml->row = row;
+        ml->version = S->version;
+        E.matchscans++;
+    }
+    return ml;
+}
 
-    static int saved_hl_line;
-    static char *saved_hl = NULL;
+// 第 at 行的内容改变或者被删除，丢弃它缓存的匹配
+void editorMatchForget(erow *row, size_t at)
+{
+    if (E.matchcache && E.matchcache[at % EDITOR_MATCH_CACHE].row == row)
+        E.matchcache[at % EDITOR_MATCH_CACHE].row = NULL;
+}
 
-    if (saved_hl)
+// 等待按键时更新查找进度，返回非零表示需要重绘
+int editorFindPoll()
+{
+    struct editorSearch *S = &E.search;
+    pthread_mutex_lock(&S->lock);
+    size_t total = S->total;
+    int done = S->done;
+    int jump = 0;
+    size_t y = 0, x = 0;
+    if (!S->found)
     {
-        memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-        free(saved_hl);
-        saved_hl = NULL;
+        // 线程按行号顺序查找：目标之后已经有匹配就跳过去，找完了还没有就回到第一个
+        size_t k = searchLowerBound(S->matches, S->nmatches, S->target_y, S->target_x);
+        if (k < S->nmatches || (done && S->nmatches > 0))
+        {
+            k = k < S->nmatches ? k : 0;
+            jump = 1;
+            y = S->matches[k].y;
+            x = S->matches[k].x;
+        }
     }
+    pthread_mutex_unlock(&S->lock);
+
+    if (done)
+        editorFindStop();
+    if (jump)
+        editorFindJump(y, x);
+    if (!jump && !done && total == S->shown)
+        return 0;
+    editorFindPrompt();
+    editorSetStatusMessage(S->prompt, S->text ? S->text : "");
+    return 1;
+}
+
+void editorFindCallback(char *query, int key)
+{
+    struct editorSearch *S = &E.search;
 
     if (key == '\r' || key == '\x1b')
     {
-        last_match = -1;
-        direction = 1;
+        // 清除匹配高亮
+        E.match_row = NULL;
         return;
     }
-    else if (key == ARROR_RIGHT || key == ARROR_DOWN)
+
+    if (key == ARROR_RIGHT || key == ARROR_DOWN || key == ARROR_LEFT || key == ARROR_UP)
     {
-        direction = 1;
+        if (!S->found)
+            return;
+        size_t y = S->y, x = S->x;
+        int found;
+        if (key == ARROR_RIGHT || key == ARROR_DOWN)
+        {
+            x++;
+            found = editorFindNext(&S->q, &y, &x);
+        }
+        else
+        {
+            found = editorFindPrev(&S->q, &y, &x);
+        }
+        if (found)
+            editorFindJump(y, x);
+        editorFindPrompt();
+        return;
     }
-    else if (key == ARROR_LEFT || key == ARROR_UP)
+
+    int icase = S->icase, word = S->word, regex = S->regex;
+    if (key == CTRL_KEY('t'))
+        icase = !icase;
+    else if (key == CTRL_KEY('w'))
+        word = !word;
+    else if (key == CTRL_KEY('e'))
+        regex = !regex;
+    else if (S->text && strcmp(S->text, query) == 0)
+        return;
+
+    // 查询变了：取消还在进行的查找，从头开始新的查找
+    // 查询只是变长时，新的第一个匹配不会在当前匹配之前，跳到当前匹配之后的第一个
+    editorFindStop();
+    if (S->found && searchExtends(&S->q, query, icase, word, regex))
     {
-        direction = -1;
+        S->target_y = S->y;
+        S->target_x = S->x;
     }
     else
     {
-        last_match = -1;
-        direction = 1;
-    }
-
-    // 没有最后一个匹配项时从头部开始向前搜索
-    if (last_match == -1)
-        direction = 1;
-    int current = last_match;
-    int i;
-    // 逐行查找字符串
-    for (i = 0; i < E.numrows; i++)
-    {
-        current += direction;
-        // 向后搜索时从文件开头回到末尾
-        if (current == -1)
-            current = E.numrows - 1;
-        // 向后搜索时从文件末尾回到开头
-        else if (current == E.numrows)
-            current = 0;
-
-        erow *row = &E.row[current];
-        char *match = strstr(row->render, query);
-        if (match)
-        {
-            last_match = current;
-            E.cy = current;
-            E.cx = editorRowRxToCx(row, match - row->render); // 获取偏移量
-            E.rowoff = E.numrows;
-
-            saved_hl_line = current;
-            saved_hl = malloc(row->rsize);
-            memcpy(saved_hl, row->hl, row->rsize);
-            memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-            break;
-        }
+        S->target_y = S->origin_y;
+        S->target_x = S->origin_x;
     }
+    S->icase = icase;
+    S->word = word;
+    S->regex = regex;
+    S->found = 0;
+    E.match_row = NULL;
+    free(S->text);
+    S->text = strdup(query);
+    searchCompile(&S->q, query, icase, word, regex);
+    S->version++;
+    if (searchReady(&S->q))
+        editorFindStart();
+    editorFindPrompt();
 }
 
 void editorFind()
 {
-    int saved_cx = E.cx;
-    int saved_cy = E.cy;
-    int saved_coloff = E.coloff;
-    int saved_rowoff = E.rowoff;
-
-    char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+    // 查找需要整个文件，查找线程读取行期间也不能有保存完成时的重新映射
+    editorLoadUntil(SIZE_MAX);
+    editorSaveWait();
+    size_t saved_cx = E.cx;
+    size_t saved_cy = E.cy;
+    size_t saved_coloff = E.coloff;
+    size_t saved_rowoff = E.rowoff;
+
+    struct editorSearch *S = &E.search;
+    S->origin_y = E.cy;
+    S->origin_x = E.cx;
+    S->found = 0;
+    editorFindPrompt();
+    char *query = editorPrompt(S->prompt, editorFindCallback, 0);
+    editorFindStop();
+    searchFree(&S->q);
+    free(S->text);
+    S->text = NULL;
+    free(S->matches);
+    S->matches = NULL;
+    S->nmatches = S->matchcap = 0;
     if (query)
     {
         free(query);
@@ -970,12 +6041,222 @@ void editorFind()
     }
 }
 
+/*** replace ***/
+
+// 全部替换前找出的所有匹配，不限个数
+struct matchlist
+{
+    struct searchmatch *matches;
+    size_t n, cap;
+};
+
+int editorReplaceFlush(struct searchcollect *c)
+{
+    struct matchlist *l = c->sink;
+    if (l->n + c->nbatch > l->cap)
+    {
+        size_t cap = l->cap ? l->cap * 2 : EDITOR_FIND_BATCH;
+        while (cap < l->n + c->nbatch)
+            cap *= 2;
+        l->matches = realloc(l->matches, sizeof(struct searchmatch) * cap);
+        if (l->matches == NULL)
+            die("realloc");
+        l->cap = cap;
+    }
+    if (c->nbatch > 0)
+        memcpy(&l->matches[l->n], c->batch, sizeof(struct searchmatch) * c->nbatch);
+    l->n += c->nbatch;
+    return 1;
+}
+
+// 替换第 y 行中从 m[0, n) 开始的匹配，重叠的只替换前一个，整行只分配一次并且只重新高亮一次
+// spans 是调用者复用的缓冲区，返回替换的个数
+size_t editorReplaceRow(erow *row, size_t y, const struct searchquery *q, const struct searchmatch *m, size_t n,
+                        const char *with, size_t wlen, struct matchspan **spans, size_t *spancap)
+{
+    if (*spancap < n)
+    {
+        *spans = realloc(*spans, sizeof(struct matchspan) * n);
+        if (*spans == NULL)
+            die("realloc");
+        *spancap = n;
+    }
+    char *text = editorRowLinear(row);
+    size_t size = row->size, newsize = row->size, end = 0, ns = 0, k;
+    for (k = 0; k < n; k++)
+    {
+        size_t at = m[k].x;
+        if (at < end)
+            continue;
+        size_t len = q->regex ? regexMatchLen(q->re, text, size, at) : q->len;
+        (*spans)[ns].at = at;
+        (*spans)[ns].len = len;
+        ns++;
+        newsize = newsize - len + wlen;
+        end = at + len;
+    }
+    if (ns == 0)
+        return 0;
+
+    size_t cap = editorArenaSize(newsize + EDITOR_GAP_MIN);
+    char *chars = editorArenaAlloc(cap);
+    char *w = chars;
+    size_t from = 0;
+    for (k = 0; k < ns; k++)
+    {
+        memcpy(w, text + from, (*spans)[k].at - from);
+        w += (*spans)[k].at - from;
+        memcpy(w, with, wlen);
+        w += wlen;
+        from = (*spans)[k].at + (*spans)[k].len;
+    }
+    memcpy(w, text + from, size - from);
+
+    // 只重新生成已经显示过的行，其他行在显示前生成
+    int resident = row->render != NULL;
+    editorRowDropShared(row);
+    if (!row->mapped)
+        editorArenaFree(row->chars, row->size + row->gaplen);
+    row->chars = chars;
+    row->size = newsize;
+    row->gap = newsize;
+    row->gaplen = cap - newsize;
+    // 行数不变，只有 flat 标记需要清除，遇到已经不是 flat 的祖先就可以停止
+    if (row->mapped)
+    {
+        rownode *t;
+        row->mapped = 0;
+        for (t = (rownode *)row; t && t->flat; t = t->parent)
+            t->flat = 0;
+    }
+    if (resident)
+        editorUpdateRow(row);
+    else if (y < E.hlvalid)
+        E.hlvalid = y;
+    E.dirty++;
+    return ns;
+}
+
+// 先找出所有匹配，再按行号顺序逐行替换，返回替换的个数，替换过的行数写入 *nrows
+size_t editorReplaceAll(const struct searchquery *q, const char *with, size_t *nrows)
+{
+    // 和后台查找用同一个收集器，只是在主线程中进行，并且保存全部匹配
+    struct matchlist all = {NULL, 0, 0};
+    struct searchcollect *c = malloc(sizeof(struct searchcollect));
+    if (c == NULL)
+        die("malloc");
+    searchCollectInit(c, q, editorReplaceFlush, &all);
+    double start = editorNow();
+    editorFindPrepare(E.rowroot);
+    if (searchCollectTree(c, E.rowroot, 0))
+        searchFlush(c);
+    E.findbytes += c->bytes;
+    E.findtime += editorNow() - start;
+    free(c);
+
+    struct matchspan *spans = NULL;
+    size_t spancap = 0, count = 0, wlen = strlen(with), k = 0;
+    *nrows = 0;
+    while (k < all.n)
+    {
+        size_t y = all.matches[k].y, next = k + 1;
+        while (next < all.n && all.matches[next].y == y)
+            next++;
+        size_t n = editorReplaceRow(editorRowAt(y), y, q, &all.matches[k], next - k, with, wlen, &spans, &spancap);
+        count += n;
+        *nrows += n > 0;
+        k = next;
+    }
+    free(spans);
+    free(all.matches);
+    return count;
+}
+
+void editorReplacePrompt()
+{
+    struct editorSearch *S = &E.search;
+    snprintf(S->prompt, sizeof(S->prompt), "Replace%s%s%s: %%s  ESC ^T/^W/^E",
+             S->regex ? " [re]" : "", S->icase ? " [i]" : "", S->word ? " [w]" : "");
+}
+
+void editorReplaceCallback(char *query, int key)
+{
+    struct editorSearch *S = &E.search;
+    (void)query;
+    if (key == CTRL_KEY('t'))
+        S->icase = !S->icase;
+    else if (key == CTRL_KEY('w'))
+        S->word = !S->word;
+    else if (key == CTRL_KEY('e'))
+        S->regex = !S->regex;
+    editorReplacePrompt();
+}
+
+// 全部替换，选项和查找共用
+void editorReplace()
+{
+    // 和查找一样需要整个文件，也不能和保存完成时的重新映射同时进行
+    editorLoadUntil(SIZE_MAX);
+    editorSaveWait();
+
+    struct editorSearch *S = &E.search;
+    editorReplacePrompt();
+    char *query = editorPrompt(S->prompt, editorReplaceCallback, 0);
+    if (query == NULL)
+        return;
+    struct searchquery q;
+    memset(&q, 0, sizeof(q));
+    if (searchCompile(&q, query, S->icase, S->word, S->regex) != 0)
+    {
+        editorSetStatusMessage("Regex error: %s", q.error);
+        searchFree(&q);
+        free(query);
+        return;
+    }
+    char *with = editorPrompt("Replace with: %s (ESC to cancel)", NULL, 1);
+    if (with)
+    {
+        double start = editorNow();
+        size_t nrows;
+        size_t count = editorReplaceAll(&q, with, &nrows);
+        double elapsed = editorNow() - start;
+        E.match_row = NULL;
+        if (E.cy < E.numrows && E.cx > editorRowAt(E.cy)->size)
+            E.cx = editorRowAt(E.cy)->size;
+        char n[32], r[32];
+        editorFormatCount(n, sizeof(n), count);
+        editorFormatCount(r, sizeof(r), nrows);
+        editorSetStatusMessage("Replaced %s occurrences in %s rows in %.3f s", n, r, elapsed);
+        free(with);
+    }
+    searchFree(&q);
+    free(query);
+}
+
+/*** goto line ***/
+
+void editorGotoLine()
+{
+    char *input = editorPrompt("Go to line: %s (ESC to cancel)", NULL, 0);
+    if (input == NULL)
+        return;
+    size_t line = strtoull(input, NULL, 10);
+    free(input);
+
+    // 行树按行号定位只需 O(log n)，后台加载时只等待加载到这一行
+    editorLoadUntil(line);
+    if (line > E.numrows)
+        line = E.numrows;
+    E.cy = line > 0 ? line - 1 : 0;
+    E.cx = 0;
+}
+
 /*** append buffer ***/
 
 struct abuf
 {
     char *b; // 指向内存缓冲区的指针
-    int len; // 长度
+    size_t len; // 长度
 };
 
 // 代表一个空缓冲区
@@ -985,7 +6266,7 @@ struct abuf
     }
 
 // 写入缓冲区
-void abAppend(struct abuf *ab, const char *s, int len)
+void abAppend(struct abuf *ab, const char *s, size_t len)
 {
     // 申请新的内存块，大小是当前缓冲区增加 len 的长度
     char *new = realloc(ab->b, ab->len + len);
@@ -1004,6 +6285,50 @@ void abFree(struct abuf *ab)
     free(ab->b);
 }
 
+/*** background ***/
+
+// 单调时钟的当前时间，单位秒
+double editorNow()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 标准输入中是否已经有待读取的按键
+int editorInputPending()
+{
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    return poll(&pfd, 1, 0) > 0;
+}
+
+// 等待按键时定期检查后台任务，返回非零表示需要重绘屏幕
+int editorPollBackground()
+{
+    if (E.search.active && editorFindPoll())
+        return 1;
+    int indexing = editorTrigramPoll();
+    if (E.loader.active)
+    {
+        // 没有按键时尽量多地接入，有按键时先返回处理按键，并定期返回以更新进度
+        double start = editorNow();
+        while (editorLoadIngest() > 0 && !editorInputPending() &&
+               editorNow() - start < EDITOR_POLL_BUDGET)
+            ;
+        return 1;
+    }
+    if (!E.save.active)
+        return indexing;
+
+    pthread_mutex_lock(&E.save.lock);
+    int done = E.save.done;
+    pthread_mutex_unlock(&E.save.lock);
+    if (done)
+        editorSaveWait();
+    // 保存进行中时也重绘，以更新状态栏中的进度
+    return 1;
+}
+
 /*** output ***/
 
 void editorScroll()
@@ -1012,7 +6337,7 @@ void editorScroll()
     // 计算有可能存在的制表符对应光标位置
     if (E.cy < E.numrows)
     {
-        E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+        E.rx = editorRowCxToRx(editorRowAt(E.cy), E.cx);
     }
 
     // 光标在顶部向上移动
@@ -1036,13 +6361,119 @@ void editorScroll()
     }
 }
 
-void editorDrawRows(struct abuf *ab)
+// 第 j 个字符的高亮类型，*stop 设为同类型区间的结尾
+// *k 和 *mk 是高亮区间和匹配的下标，从前往后依次查询时不必回头查找
+unsigned char editorRowSpanAt(erow *row, const struct matchline *ml, size_t j, size_t *k, size_t *mk,
+                              size_t *stop)
+{
+    while (*k < row->nhl && row->hl[*k].start + row->hl[*k].len <= j)
+        (*k)++;
+    unsigned char type = HL_NORMAL;
+    *stop = row->rsize;
+    if (*k < row->nhl)
+    {
+        hlspan *span = &row->hl[*k];
+        if (span->start <= j)
+        {
+            type = span->type;
+            *stop = span->start + span->len;
+        }
+        else
+        {
+            *stop = span->start;
+        }
+    }
+    // 搜索匹配覆盖在语法高亮之上，当前匹配又覆盖在其他匹配之上
+    if (ml)
+    {
+        while (*mk < ml->nspans && ml->spans[*mk].at + ml->spans[*mk].len <= j)
+            (*mk)++;
+        if (*mk < ml->nspans)
+        {
+            const struct matchspan *m = &ml->spans[*mk];
+            if (m->at <= j)
+            {
+                type = HL_MATCHALL;
+                *stop = m->at + m->len;
+            }
+            else if (*stop > m->at)
+            {
+                *stop = m->at;
+            }
+        }
+    }
+    if (row == E.match_row)
+    {
+        size_t mend = E.match_start + E.match_len;
+        if (j >= E.match_start && j < mend)
+        {
+            type = HL_MATCH;
+            *stop = mend;
+        }
+        else if (j < E.match_start && *stop > E.match_start)
+        {
+            *stop = E.match_start;
+        }
+    }
+    return type;
+}
+
+// 在一格中放入字符，不可见字符替换为 @A-Z 或 ? 并反色显示
+void editorFramePut(struct screencell *cell, char c, int color)
+{
+    if (iscntrl((unsigned char)c))
+    {
+        cell->c = c <= 26 ? '@' + c : '?';
+        cell->color = 7;
+        return;
+    }
+    cell->c = c;
+    cell->color = color;
+}
+
+void editorFramePuts(struct screencell *line, const char *s, int len, int color)
+{
+    int i;
+    for (i = 0; i < len; i++)
+        editorFramePut(&line[i], s[i], color);
+}
+
+// 画出一行中落在 [coloff, coloff + screencols) 中的列，tab 只在这里展开，ml 是行中的匹配
+void editorDrawRow(struct screencell *line, erow *row, const struct matchline *ml)
+{
+    size_t rx = 0;
+    size_t end = E.coloff + E.screencols;
+    size_t j = 0, k = 0, mk = 0, stop;
+    while (j < row->rsize && rx < end)
+    {
+        unsigned char type = editorRowSpanAt(row, ml, j, &k, &mk, &stop);
+        int color = type == HL_NORMAL ? -1 : editorSyntaxToColor(type);
+        for (; j < stop && rx < end; j++)
+        {
+            char c = row->render[j];
+            // tab 展开为到下一个制表位的空格，每个制表符至少占一列
+            size_t width = 1;
+            if (c == '\t')
+            {
+                width = EDITOR_TAB_STOP - rx % EDITOR_TAB_STOP;
+                c = ' ';
+            }
+            for (; width > 0 && rx < end; width--, rx++)
+                if (rx >= E.coloff)
+                    editorFramePut(&line[rx - E.coloff], c, color);
+        }
+    }
+}
+
+void editorDrawRows(struct screencell *cells)
 {
     int y;
+    erow *row = editorRowAt(E.rowoff);
     for (y = 0; y < E.screenrows; y++)
     {
+        struct screencell *line = &cells[y * E.screencols];
         // 当前光标所在行
-        int filerow = y + E.rowoff;
+        size_t filerow = y + E.rowoff;
         // 当前光标所在行是否在文本缓冲区内
         if (filerow >= E.numrows)
         {
@@ -1056,171 +6487,280 @@ void editorDrawRows(struct abuf *ab)
                 // 如果字符串长度大于终端列数，截断
                 if (welcomelen > E.screencols)
                     welcomelen = E.screencols;
-                // 计算让字符串居中的填充长度
+                // 计算让字符串居中的填充长度，第一个填充位置画波浪号
                 int padding = (E.screencols - welcomelen) / 2;
-                // 第一个填充字符串打印波浪号，剩下打印空格
                 if (padding)
-                {
-                    abAppend(ab, "~", 1);
-                    padding--;
-                }
-                while (padding--)
-                    abAppend(ab, " ", 1);
-                abAppend(ab, welcome, welcomelen);
+                    editorFramePut(&line[0], '~', -1);
+                editorFramePuts(&line[padding], welcome, welcomelen, -1);
             }
             else
             {
                 // 非文件内容的行，画波浪线
-                abAppend(ab, "~", 1);
+                editorFramePut(&line[0], '~', -1);
             }
         }
         else
         {
-            // 减去列偏移量的行长度
-            int len = E.row[filerow].rsize - E.coloff;
-            // 如果当前行已经到达末端（len <= 0），若 len < 0，令 len = 0 传递给 abAppend
-            if (len < 0)
-                len = 0;
-            // 大于终端列数则截断
-            if (len > E.screencols)
-                len = E.screencols;
-            char *c = &E.row[filerow].render[E.coloff];
-            unsigned char *hl = &E.row[filerow].hl[E.coloff];
-            int current_color = -1;
-            int j;
-            for (j = 0; j < len; j++)
-            {
-                if (iscntrl(c[j]))
-                {
-                    // 替代不可见字符并颜色反转打印
-                    char sym = (c[j] <= 26 ? '@' + c[j] : '?');
-                    abAppend(ab, "\x1b[7m", 4);
-                    abAppend(ab, &sym, 1);
-                    abAppend(ab, "\x1b[m", 3);
-                    if (current_color != -1)
-                    {
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-                        abAppend(ab, buf, clen);
-                    }
-                }
-                else if (hl[j] == HL_NORMAL)
-                {
-                    if (current_color != -1)
-                    {
-                        abAppend(ab, "\x1b[39m", 5);
-                        current_color = -1;
-                    }
-                    abAppend(ab, &c[j], 1);
-                }
-                else
-                {
-                    int color = editorSyntaxToColor(hl[j]);
-                    if (color != current_color)
-                    {
-                        current_color = color;
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-                        abAppend(ab, buf, clen);
-                    }
-                    abAppend(ab, &c[j], 1);
-                }
-            }
-            abAppend(ab, "\x1b[39m", 5);
+            editorRowLoad(row);
+            editorDrawRow(line, row, editorMatchLine(row, filerow));
+            row = editorRowNext(row);
         }
-
-        // K 指令擦除当前行的一部分
-        // 2 擦除整行，1 和 0 擦除光标右侧的行部分，默认参数 0
-        abAppend(ab, "\x1b[K", 3);
-
-        abAppend(ab, "\r\n", 2);
     }
 }
 
-void editorDrawStatusBar(struct abuf *ab)
+void editorDrawStatusBar(struct screencell *line)
 {
-    // m 命令设置文本属性，参数：
-    // 1 粗体，4 下划线，5 闪烁，7 反转颜色，0 清除所有属性（默认参数）
-    abAppend(ab, "\x1b[7m", 4);
     char status[80], rstatus[80];
+    char saving[24] = "";
+    if (E.loader.active)
+        snprintf(saving, sizeof(saving), " [loading %d%%]", editorLoadProgress());
+    else if (E.save.active)
+        snprintf(saving, sizeof(saving), " [saving %d%%]", editorSaveProgress());
+    else if (E.trigram.active)
+        snprintf(saving, sizeof(saving), " [indexing %d%%]", editorTrigramProgress());
     // 文件名以及是否修改提示
-    int len = snprintf(status, sizeof(status), "%.20s %s",
+    int len = snprintf(status, sizeof(status), "%.20s %s%s",
                        E.filename ? E.filename : "[No name]",
-                       E.dirty ? "(modified)" : "");
+                       E.dirty ? "(modified)" : "", saving);
     // 行号和文件类型
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
+    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %zu/%zu",
                         E.syntax ? E.syntax->filetype : "No filetype", E.cy + 1, E.numrows);
 
+    // 状态栏整行反色，第二个状态字符串靠右，放不下时不显示
+    int x;
+    for (x = 0; x < E.screencols; x++)
+        editorFramePut(&line[x], ' ', 7);
     if (len > E.screencols)
         len = E.screencols;
-    abAppend(ab, status, len);
+    editorFramePuts(line, status, len, 7);
+    if (len + rlen <= E.screencols)
+        editorFramePuts(&line[E.screencols - rlen], rstatus, rlen, 7);
+}
+
+void editorDrawMessageBar(struct screencell *line)
+{
+    int msglen = strlen(E.statusmsg);
+    if (msglen > E.screencols)
+        msglen = E.screencols;
+    if (msglen && time(NULL) - E.statusmsg_time < 5)
+        editorFramePuts(line, E.statusmsg, msglen, -1);
+}
+
+// 终端大小和画面不同时重新分配，下一帧整屏重画
+void editorFrameResize()
+{
+    struct editorFrame *F = &E.frame;
+    int rows = E.screenrows + 2;
+    if (F->shown && F->rows == rows && F->cols == E.screencols)
+        return;
+    size_t n = (size_t)rows * E.screencols;
+    free(F->shown);
+    free(F->next);
+    F->shown = malloc(sizeof(struct screencell) * n);
+    F->next = malloc(sizeof(struct screencell) * n);
+    if (F->shown == NULL || F->next == NULL)
+        die("malloc");
+    F->rows = rows;
+    F->cols = E.screencols;
+    F->valid = 0;
+}
 
-    while (len < E.screencols)
+int editorCellSame(const struct screencell *a, const struct screencell *b)
+{
+    return a->c == b->c && a->color == b->color;
+}
+
+int editorCellBlank(const struct screencell *a)
+{
+    return a->c == ' ' && a->color == -1;
+}
+
+// 把终端光标移到第 y 行第 x 列（从 0 开始），已经在那里时不输出
+void editorFrameMove(struct abuf *ab, int y, int x)
+{
+    struct editorFrame *F = &E.frame;
+    if (F->cy == y && F->cx == x)
+        return;
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+    abAppend(ab, buf, len);
+    F->cy = y;
+    F->cx = x;
+}
+
+// 切换到颜色 color，*current 是终端当前的颜色；颜色可能是背景色或反色，先清除所有属性
+void editorFrameColor(struct abuf *ab, int color, int *current)
+{
+    if (color == *current)
+        return;
+    *current = color;
+    if (color == -1)
+    {
+        abAppend(ab, "\x1b[m", 3);
+    }
+    else
     {
-        if (E.screencols - len == rlen)
+        char buf[16];
+        int clen = snprintf(buf, sizeof(buf), "\x1b[0;%dm", color);
+        abAppend(ab, buf, clen);
+    }
+}
+
+// 输出第 y 行中和终端上不同的部分：相隔很近的变化合成一段，行尾的空白用 K 指令擦除
+void editorFrameRow(struct abuf *ab, int y, int *current)
+{
+    struct editorFrame *F = &E.frame;
+    int cols = F->cols;
+    const struct screencell *now = &F->next[y * cols], *old = &F->shown[y * cols];
+    if (F->valid && memcmp(now, old, sizeof(struct screencell) * cols) == 0)
+        return;
+
+    // 终端按 UTF-8 显示时几个字节只占一列，格子和列对不上，含有非 ASCII 字节的行整行重画
+    int whole = !F->valid;
+    int x;
+    for (x = 0; x < cols && !whole; x++)
+        if ((unsigned char)now[x].c >= 0x80 || (unsigned char)old[x].c >= 0x80)
+            whole = 1;
+    int blank = cols;
+    while (blank > 0 && editorCellBlank(&now[blank - 1]))
+        blank--;
+
+    x = 0;
+    while (x < cols)
+    {
+        if (!whole)
+        {
+            while (x < cols && editorCellSame(&now[x], &old[x]))
+                x++;
+            if (x == cols)
+                break;
+        }
+        int end = blank;
+        if (!whole)
+        {
+            int e;
+            end = x + 1;
+            for (e = x + 1; e < cols && e - end < EDITOR_FRAME_GAP; e++)
+                if (!editorCellSame(&now[e], &old[e]))
+                    end = e + 1;
+        }
+        if (whole || x >= blank || end > blank)
         {
-            abAppend(ab, rstatus, rlen);
+            // 从这里到行尾都是空白；整行重画时行中的字节可能没有占满各列，也要擦除行尾
+            editorFrameMove(ab, y, x);
+            for (; x < blank; x++)
+            {
+                editorFrameColor(ab, now[x].color, current);
+                abAppend(ab, &now[x].c, 1);
+                F->cx++;
+            }
+            editorFrameColor(ab, -1, current);
+            abAppend(ab, "\x1b[K", 3);
             break;
         }
-        else
+        editorFrameMove(ab, y, x);
+        for (; x < end; x++)
         {
-            // 用空格填充，直到打印第二个状态字符串
-            abAppend(ab, " ", 1);
-            len += 1;
+            editorFrameColor(ab, now[x].color, current);
+            abAppend(ab, &now[x].c, 1);
+            F->cx++;
         }
     }
-    // 关闭颜色反转
-    abAppend(ab, "\x1b[m", 3);
-    abAppend(ab, "\r\n", 2);
+    // 整行重画后不知道光标实际停在哪一列
+    if (whole)
+        F->cy = -1;
 }
 
-void editorDrawMessageBar(struct abuf *ab)
+// 文本上下滚动时先让终端滚动文本区域，shown 随之移动，之后只需输出新露出的行
+void editorFrameScroll(struct abuf *ab)
 {
-    abAppend(ab, "\x1b[K", 3);
-    int msglen = strlen(E.statusmsg);
-    if (msglen > E.screencols)
-        msglen = E.screencols;
-    if (msglen && time(NULL) - E.statusmsg_time < 5)
-        abAppend(ab, E.statusmsg, msglen);
+    struct editorFrame *F = &E.frame;
+    if (!F->valid || E.rowoff == F->rowoff || E.coloff != F->coloff)
+        return;
+    int up = E.rowoff > F->rowoff;
+    size_t d = up ? E.rowoff - F->rowoff : F->rowoff - E.rowoff;
+    if (d >= (size_t)E.screenrows)
+        return;
+    int n = (int)d, keep = E.screenrows - n;
+    // 设置滚动区域为文本行，S 向上滚动，T 向下滚动，最后恢复滚动区域，光标回到左上角
+    char buf[48];
+    int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r", E.screenrows, n, up ? 'S' : 'T');
+    abAppend(ab, buf, len);
+    F->cy = -1;
+
+    size_t cols = F->cols;
+    struct screencell *from = up ? &F->shown[n * cols] : F->shown;
+    struct screencell *to = up ? F->shown : &F->shown[n * cols];
+    memmove(to, from, sizeof(struct screencell) * keep * cols);
+    // 新露出的行在终端上是空白
+    struct screencell *fresh = up ? &F->shown[keep * cols] : F->shown;
+    size_t i;
+    for (i = 0; i < n * cols; i++)
+    {
+        fresh[i].c = ' ';
+        fresh[i].color = -1;
+    }
 }
 
 void editorRefreshScreen()
 {
+    // 接入后台加载的行，光标所在的一屏还没加载时等待
+    editorLoadUntil(E.cy + E.screenrows);
     editorScroll();
+    // 显示之前确保可见行之前的高亮状态可靠
+    editorSyntaxValidate(E.rowoff + E.screenrows);
+    editorEvictRows();
+
+    // 先在 next 中画出整个画面：文本行、状态栏和消息栏
+    struct editorFrame *F = &E.frame;
+    editorFrameResize();
+    size_t i, n = (size_t)F->rows * F->cols;
+    for (i = 0; i < n; i++)
+    {
+        F->next[i].c = ' ';
+        F->next[i].color = -1;
+    }
+    editorDrawRows(F->next);
+    editorDrawStatusBar(&F->next[E.screenrows * F->cols]);
+    editorDrawMessageBar(&F->next[(E.screenrows + 1) * F->cols]);
 
+    // 只输出和终端上不同的格子，整屏重画时终端光标的位置不确定
     struct abuf ab = ABUF_INIT;
-
-    // 刷新屏幕内容之前隐藏光标，该控制指令非 VT100 标准
-    abAppend(&ab, "\x1b[?25l", 6);
-
-    // // 写 4 字节到终端，第一个字节是 \x1b 即转义字符 27，其它三个字节为[2J]
-    // // \x1b[ 表示执行终端文本格式设置
-    // // J 命令清除屏幕，参数 2 表示清除整个屏幕
-    // // 使用 VT100 转义序列，为了适应更多终端可使用 ncurses 库计算转义序列
-    // abAppend(&ab, "\x1b[2J", 4);
-
-    // H 命令定位光标，H 命令有两个参数分别表示定位行号和列号
-    // 多个参数用 ; 分隔，如 [12;40H，让 80x24 大小的终端光标定位在第一行和第一列
-    // H 默认参数都为 1，这里省略参数
-    abAppend(&ab, "\x1b[H", 3);
-
-    // 重新显示光标
-    abAppend(&ab, "\x1b[?25h", 6);
-
-    editorDrawRows(&ab);
-    // 绘制状态栏
-    editorDrawStatusBar(&ab);
-    // 绘制消息栏
-    editorDrawMessageBar(&ab);
-
-    // 画完之后，重新移动光标位置
-    char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
-    abAppend(&ab, buf, strlen(buf));
+    int current = -1;
+    int y;
+    if (!F->valid)
+        F->cy = -1;
+    editorFrameScroll(&ab);
+    for (y = 0; y < F->rows; y++)
+        editorFrameRow(&ab, y, &current);
+    editorFrameColor(&ab, -1, &current);
+
+    // 有输出时先隐藏光标，画完之后移到编辑位置再显示，该控制指令非 VT100 标准
+    struct abuf out = ABUF_INIT;
+    if (ab.len > 0)
+    {
+        abAppend(&out, "\x1b[?25l", 6);
+        abAppend(&out, ab.b, ab.len);
+    }
+    editorFrameMove(&out, E.cy - E.rowoff, E.rx - E.coloff);
+    if (ab.len > 0)
+        abAppend(&out, "\x1b[?25h", 6);
+    abFree(&ab);
 
     // 缓冲区内容写到终端
-    write(STDOUT_FILENO, ab.b, ab.len);
-    abFree(&ab);
+    if (out.len > 0)
+        write(STDOUT_FILENO, out.b, out.len);
+    F->lastbytes = out.len;
+    F->bytes += out.len;
+    F->frames++;
+    abFree(&out);
+
+    struct screencell *t = F->shown;
+    F->shown = F->next;
+    F->next = t;
+    F->valid = 1;
+    F->rowoff = E.rowoff;
+    F->coloff = E.coloff;
 }
 
 void editorSetStatusMessage(const char *fmt, ...)
@@ -1234,7 +6774,8 @@ void editorSetStatusMessage(const char *fmt, ...)
 
 /*** input ***/
 
-char *editorPrompt(char *prompt, void (*callback)(char *, int))
+// allowempty 不为 0 时，没有输入也可以按回车确认
+char *editorPrompt(char *prompt, void (*callback)(char *, int), int allowempty)
 {
     size_t bufsize = 128;
     char *buf = malloc(bufsize);
@@ -1264,7 +6805,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int))
         }
         else if (c == '\r') // 按下回车时且输入不为空，清空消息信息并返回
         {
-            if (buflen != 0)
+            if (buflen != 0 || allowempty)
             {
                 editorSetStatusMessage("");
                 if (callback)
@@ -1293,8 +6834,10 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int))
 
 void editorMoveCursor(int key)
 {
+    // 向下移动到已加载部分之外时等待加载
+    editorLoadUntil(E.cy + 2);
     // 确保光标 cy 在文件实际内容行上而不是超过了最后一行
-    erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    erow *row = editorRowAt(E.cy);
 
     switch (key)
     {
@@ -1307,7 +6850,7 @@ void editorMoveCursor(int key)
         {
             // 不在第一行时，移动光标到上一行结尾
             E.cy--;
-            E.cx = E.row[E.cy].size;
+            E.cx = editorRowAt(E.cy)->size;
         }
         break;
     case ARROR_RIGHT:
@@ -1336,8 +6879,8 @@ void editorMoveCursor(int key)
         break;
     }
 
-    row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
-    int rowlen = row ? row->size : 0;
+    row = editorRowAt(E.cy);
+    size_t rowlen = row ? row->size : 0;
     if (E.cx > rowlen)
     {
         E.cx = rowlen;
@@ -1365,6 +6908,10 @@ void editorProcessKeypress()
             quit_times--;
             return;
         }
+        // 等待正在进行的后台保存完成
+        editorSaveWait();
+        editorCacheSaveStates();
+        editorFreeRows();
         // Ctrl-q 退出时清理屏幕和定位光标
         write(STDOUT_FILENO, "\x1b[2J", 4);
         write(STDOUT_FILENO, "\x1b[H", 3);
@@ -1376,6 +6923,10 @@ void editorProcessKeypress()
         editorSave();
         break;
 
+    case CTRL_KEY('t'):
+        editorShowStats();
+        break;
+
     case HOME_KEY:
         E.cx = 0;
         break;
@@ -1383,13 +6934,21 @@ void editorProcessKeypress()
     case END_KEY:
         // 滚动到行末尾，首先要确认在文件内容段中才响应 End 键
         if (E.cy < E.numrows)
-            E.cx = E.row[E.cy].size;
+            E.cx = editorRowAt(E.cy)->size;
         break;
 
     case CTRL_KEY('f'):
         editorFind();
         break;
 
+    case CTRL_KEY('g'):
+        editorGotoLine();
+        break;
+
+    case CTRL_KEY('r'):
+        editorReplace();
+        break;
+
     case BACKSPACE:
     // Ctrl-H 发送 8 （Backspace 的 ASCII 码）
     case CTRL_KEY('h'):
@@ -1435,6 +6994,10 @@ void editorProcessKeypress()
 
     // Ctrl-L 用于终端上刷新屏幕，编辑器不需要该功能
     case CTRL_KEY('l'):
+        // 终端上的内容可能被其他程序改过，下一帧整屏重画
+        E.frame.valid = 0;
+        break;
+
     case '\x1b':
         break;
 
@@ -1446,6 +7009,253 @@ void editorProcessKeypress()
     quit_times = EDITOR_QUIT_TIMES;
 }
 
+/*** syntax files ***/
+
+// 语法定义文件每行一个设置，# 开头的行是注释：
+//   name Rust
+//   match .rs
+//   comment //
+//   multiline /* */
+//   highlight numbers strings
+//   keywords fn let mut ...
+//   types i32 u64 ...
+// match、keywords 和 types 可以写多行
+
+// 在以 NULL 结尾的数组末尾加入一项
+char **editorListAppend(char **list, char *item)
+{
+    size_t n = 0;
+    while (list && list[n])
+        n++;
+    list = realloc(list, sizeof(char *) * (n + 2));
+    if (list == NULL)
+        die("realloc");
+    list[n] = item;
+    list[n + 1] = NULL;
+    return list;
+}
+
+void editorFreeList(char **list)
+{
+    size_t n;
+    for (n = 0; list && list[n]; n++)
+        free(list[n]);
+    free(list);
+}
+
+// 注释符过长时 DFA 无法等到它结束
+char *editorSyntaxDelim(const char *arg)
+{
+    if (arg == NULL || strlen(arg) > EDITOR_LEX_PENDING)
+        return NULL;
+    return strdup(arg);
+}
+
+// 读取一个语法定义文件，格式错误时返回 -1 并在 err 中写出原因
+int editorLoadSyntaxFile(const char *path, struct editorSyntax *s, char *err, size_t errlen)
+{
+    const char *ws = " \t\r\n";
+    memset(s, 0, sizeof(*s));
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+        snprintf(err, errlen, "%s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t linecap = 0;
+    int lineno = 0, ret = 0;
+    while (getline(&line, &linecap, fp) != -1)
+    {
+        lineno++;
+        char *key = strtok(line, ws);
+        char *arg;
+        if (key == NULL || key[0] == '#')
+            continue;
+
+        if (!strcmp(key, "name"))
+        {
+            free(s->filetype);
+            s->filetype = (arg = strtok(NULL, ws)) ? strdup(arg) : NULL;
+            if (s->filetype == NULL)
+                ret = -1;
+        }
+        else if (!strcmp(key, "match"))
+        {
+            while ((arg = strtok(NULL, ws)))
+                s->filematch = editorListAppend(s->filematch, strdup(arg));
+        }
+        else if (!strcmp(key, "keywords") || !strcmp(key, "types"))
+        {
+            // 第二类关键字和内置定义一样以 | 结尾
+            int second = key[0] == 't';
+            while ((arg = strtok(NULL, ws)))
+            {
+                char *word = malloc(strlen(arg) + 2);
+                if (word == NULL)
+                    die("malloc");
+                sprintf(word, second ? "%s|" : "%s", arg);
+                s->keywords = editorListAppend(s->keywords, word);
+            }
+        }
+        else if (!strcmp(key, "comment"))
+        {
+            free(s->singleline_comment_start);
+            s->singleline_comment_start = editorSyntaxDelim(strtok(NULL, ws));
+            if (s->singleline_comment_start == NULL)
+                ret = -1;
+        }
+        else if (!strcmp(key, "multiline"))
+        {
+            free(s->multiline_comment_start);
+            free(s->multiline_comment_end);
+            s->multiline_comment_start = editorSyntaxDelim(strtok(NULL, ws));
+            s->multiline_comment_end = editorSyntaxDelim(strtok(NULL, ws));
+            if (s->multiline_comment_start == NULL || s->multiline_comment_end == NULL)
+                ret = -1;
+        }
+        else if (!strcmp(key, "highlight"))
+        {
+            while ((arg = strtok(NULL, ws)))
+            {
+                if (!strcmp(arg, "numbers"))
+                    s->flags |= HL_HIGHLIGHT_NUMBERS;
+                else if (!strcmp(arg, "strings"))
+                    s->flags |= HL_HIGHLIGHT_STRINGS;
+                else
+                    break;
+            }
+            if (arg)
+                ret = -1;
+        }
+        else
+        {
+            ret = -1;
+        }
+
+        if (ret)
+        {
+            snprintf(err, errlen, "%s:%d: bad line", path, lineno);
+            break;
+        }
+    }
+    free(line);
+    fclose(fp);
+
+    if (ret == 0 && (s->filetype == NULL || s->filematch == NULL))
+    {
+        snprintf(err, errlen, "%s: missing name or match", path);
+        ret = -1;
+    }
+    if (ret)
+    {
+        free(s->filetype);
+        editorFreeList(s->filematch);
+        editorFreeList(s->keywords);
+        free(s->singleline_comment_start);
+        free(s->multiline_comment_start);
+        free(s->multiline_comment_end);
+        return -1;
+    }
+    if (s->keywords == NULL)
+        s->keywords = calloc(1, sizeof(char *));
+    if (s->keywords == NULL)
+        die("calloc");
+    return 0;
+}
+
+// 启动时编译一个文件类型的关键字表和字符分类表，高亮 DFA 在选中文件类型时编译
+void editorCompileOne(struct editorSyntax *s)
+{
+    editorCompileKeywords(s);
+    editorCompileClasses(s);
+}
+
+// 把加载的文件类型加到 syntaxdb 末尾
+void editorAddSyntax(struct editorSyntax *s)
+{
+    E.syntaxdb = realloc(E.syntaxdb, sizeof(struct editorSyntax) * (E.nsyntax + 1));
+    if (E.syntaxdb == NULL)
+        die("realloc");
+    E.syntaxdb[E.nsyntax++] = *s;
+}
+
+int editorCompareNames(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// 读取语法定义目录中的 *.syntax 文件，按文件名顺序加入
+void editorLoadSyntaxDir()
+{
+    char dir[1024];
+    const char *xdg = getenv("XDG_CONFIG_HOME");
+    const char *home = getenv("HOME");
+    if (xdg && xdg[0])
+        snprintf(dir, sizeof(dir), "%s/kilo/syntax", xdg);
+    else if (home && home[0])
+        snprintf(dir, sizeof(dir), "%s/.config/kilo/syntax", home);
+    else
+        return;
+
+    DIR *d = opendir(dir);
+    if (d == NULL)
+        return;
+    char **names = NULL;
+    size_t n = 0, j;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL)
+    {
+        size_t len = strlen(ent->d_name);
+        if (len <= 7 || strcmp(&ent->d_name[len - 7], ".syntax"))
+            continue;
+        names = realloc(names, sizeof(char *) * (n + 1));
+        if (names == NULL)
+            die("realloc");
+        names[n++] = strdup(ent->d_name);
+    }
+    closedir(d);
+    qsort(names, n, sizeof(char *), editorCompareNames);
+
+    for (j = 0; j < n; j++)
+    {
+        char path[2048], err[96];
+        struct editorSyntax s;
+        snprintf(path, sizeof(path), "%s/%s", dir, names[j]);
+        if (editorLoadSyntaxFile(path, &s, err, sizeof(err)) == 0)
+        {
+            editorCompileOne(&s);
+            editorAddSyntax(&s);
+        }
+        else
+        {
+            editorSetStatusMessage("%s", err);
+        }
+        free(names[j]);
+    }
+    free(names);
+}
+
+// 启动时加载语法定义文件，再加入没有被覆盖的内置文件类型
+void editorCompileSyntax()
+{
+    unsigned int j;
+    size_t k;
+    editorLoadSyntaxDir();
+    size_t loaded = E.nsyntax;
+    for (j = 0; j < HLDB_ENTRIES; j++)
+    {
+        for (k = 0; k < loaded; k++)
+            if (!strcmp(E.syntaxdb[k].filetype, HLDB[j].filetype))
+                break;
+        if (k < loaded)
+            continue;
+        editorCompileOne(&HLDB[j]);
+        editorAddSyntax(&HLDB[j]);
+    }
+}
+
 /*** init ***/
 
 void initEditor()
@@ -1456,29 +7266,54 @@ void initEditor()
     E.rowoff = 0;
     E.coloff = 0;
     E.numrows = 0;
-    E.row = NULL;
+    E.rowroot = NULL;
+    E.rowops = 0;
+    E.rowtime = 0;
+    E.hlbytes = 0;
+    E.hltime = 0;
+    E.hlvalid = 0;
+    memset(&E.arena, 0, sizeof(E.arena));
+    E.reslo = E.reshi = 0;
+    E.match_row = NULL;
+    E.matchcache = NULL;
+    E.matchscans = 0;
+    memset(&E.search, 0, sizeof(E.search));
+    pthread_mutex_init(&E.search.lock, NULL);
+    E.findbytes = 0;
+    E.findtime = 0;
+    E.map = NULL;
+    E.mapsize = 0;
     E.dirty = 0;
+    E.save.active = 0;
+    E.save.blocks = NULL;
+    E.loader.active = 0;
+    memset(&E.cache, 0, sizeof(E.cache));
     E.filename = NULL;
+    memset(&E.frame, 0, sizeof(E.frame));
     E.statusmsg[0] = '\0';
     E.statusmsg_time = 0;
     E.syntax = NULL;
-
-    if (getWindowSize(&E.screenrows, &E.screencols) == -1)
-        die("getWindowSize");
-    // 预留底部状态栏空间
-    E.screenrows -= 2;
+    E.syntaxdb = NULL;
+    E.nsyntax = 0;
+    editorCompileSyntax();
 }
 
 int main(int argc, char *argv[])
 {
     enableRawMode();
     initEditor();
+    if (getWindowSize(&E.screenrows, &E.screencols) == -1)
+        die("getWindowSize");
+    // 预留底部状态栏空间
+    E.screenrows -= 2;
     if (argc >= 2)
     {
         editorOpen(argv[1]);
     }
 
-    editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-X = quit | Ctrl-F = find");
+    // 加载语法定义出错时保留错误信息
+    if (E.statusmsg[0] == '\0')
+        editorSetStatusMessage("HELP: Ctrl-S save | Ctrl-X quit | Ctrl-F find | Ctrl-R replace | Ctrl-G goto");
 
     while (1)
     {
@@ -0,0 +1,75 @@
+#!/bin/sh
+# 打开、编辑并保存一个 5 GB 以上的稀疏文件
+# 文件是 "head"、29 行 "pad"、一行 5 GB 的 0 字节、29 行 "pad" 和 "tail"，共 61 行
+# 在第一行开头插入 X，在最后一行末尾插入 Y；长行前后各有一屏以上的短行，编辑时不显示它
+# 保存后的文件不再稀疏，需要 5 GB 以上的磁盘空间，TMPDIR 可以指定放在哪里
+set -e
+
+KILO=${KILO:-./kilo}
+SIZE=$((5 * 1024 * 1024 * 1024))
+
+dir=$(mktemp -d)
+# 失败退出时也要结束 kilo，否则留下的进程占着 5 GB 的映射
+trap 'pkill -f "$dir/" || true; rm -rf "$dir"' EXIT
+file=$dir/sparse
+
+pad() {
+    i=0
+    while [ $i -lt 29 ]; do
+        printf 'pad\n'
+        i=$((i + 1))
+    done
+}
+{
+    printf 'head\n'
+    pad
+} > "$file"
+start=$(wc -c < "$file" | tr -d ' ')
+truncate -s $((start + SIZE)) "$file"
+{
+    printf '\n'
+    pad
+    printf 'tail\n'
+} >> "$file"
+orig=$(wc -c < "$file" | tr -d ' ')
+
+# script(1) 提供终端，按键从 FIFO 送入，Ctrl-X 等待后台保存完成后退出
+mkfifo "$dir/keys"
+script -qec "stty rows 24 cols 80; $KILO $file" /dev/null < "$dir/keys" > "$dir/screen" &
+pid=$!
+exec 3> "$dir/keys"
+# 画出第一屏之前终端还不是原始模式，Ctrl-S 会被当作 XOFF
+# 等状态栏而不是帮助信息，第一屏来得晚时帮助信息已经过了 5 秒不再显示
+tries=0
+until grep -q "No filetype" "$dir/screen"; do
+    tries=$((tries + 1))
+    if [ $tries -gt 1200 ]; then
+        echo "sparse: kilo did not start"
+        exit 1
+    fi
+    sleep 0.1
+done
+# X, Ctrl-G 61 Enter, End, Y, Ctrl-S, 保存期间文件仍有未保存的修改，Ctrl-X 按三次
+printf 'X\00761\r\033[FY\023\030\030\030' >&3
+wait $pid
+exec 3>&-
+
+fail=0
+check() {
+    if [ "$2" != "$3" ]; then
+        echo "sparse: $1: expected '$3', got '$2'"
+        fail=1
+    fi
+}
+check size "$(wc -c < "$file" | tr -d ' ')" $((orig + 2))
+check head "$(head -c 6 "$file" | od -An -c | tr -s ' ')" "$(printf 'Xhead\n' | od -An -c | tr -s ' ')"
+check tail "$(tail -c 7 "$file" | od -An -c | tr -s ' ')" "$(printf '\ntailY\n' | od -An -c | tr -s ' ')"
+# 长行前后的短行和中间的 0 字节原样保留
+check before "$(dd if="$file" bs=1 skip=$((start - 3)) count=4 2> /dev/null)" "pad"
+check after "$(dd if="$file" bs=1 skip=$((start + SIZE + 2)) count=4 2> /dev/null)" "pad"
+check zeros "$(dd if="$file" bs=1M skip=2560 count=1 2> /dev/null | tr -d '\000' | wc -c | tr -d ' ')" 0
+
+if [ $fail -eq 0 ]; then
+    echo "sparse: ok"
+fi
+exit $fail